@@ -0,0 +1,456 @@
+/*
+ ============================================================================
+ Name        : bench.c
+ Description : Microbenchmarks for the frame pipeline of snaked
+ Author      : Maurits van der Schee <maurits@vdschee.nl>
+ URL         : https://github.com/mevdschee/daemon-games
+ ============================================================================
+ */
+#define SNAKE_NO_MAIN
+#include "snaked.c"
+
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+// keep timing an operation until this many nanoseconds have passed
+#define BENCH_TIME 200000000ULL
+// skip a size when the previous size predicts a slower operation
+#define BENCH_MAX_OP 5000000000ULL
+
+typedef struct bench_t bench_t;
+typedef struct bench_result_t bench_result_t;
+
+struct bench_t {
+	int width;
+	int height;
+	int players;
+	snake_t *snake;
+	strbuf_t *sb;
+	// the board before the last next frame, for the diff kernels
+	snake_cell_t *copy;
+	diff_t *diff;
+	// a room of real sockets for on_tick, peers hold the client ends
+	daemon_t *daemon;
+	lobby_room_t room;
+	int *peers;
+	int tick;
+};
+
+// a result line of an earlier run
+struct bench_result_t {
+	char name[128];
+	double ns;
+	double bytes;
+};
+
+bench_result_t *bench_baseline;
+int bench_nbaseline;
+
+uint64_t bench_clock()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// players start in their own column heading down, so on a wrapping board
+// they live until they eat enough to bite their own tail
+void bench_setup(bench_t *bench, int width, int height, int players)
+{
+	int i, x;
+	struct snake_player_t *player;
+
+	memset(bench,0,sizeof(*bench));
+	bench->width = width;
+	bench->height = height;
+	bench->players = players;
+	bench->snake = snake_create(width, height, players);
+	bench->sb = strbuf_create();
+	for (i=0;i<players;i++) {
+		x = i * width / players;
+		player = &bench->snake->players[i];
+		player->alive = true;
+		player->head.x = player->previous_head.x = x;
+		player->head.y = player->previous_head.y = 1;
+		player->tail.x = player->previous_tail.x = x;
+		player->tail.y = player->previous_tail.y = 0;
+		player->length = 2;
+		player->direction = down;
+		snake_set_direction(bench->snake, &player->head, down);
+		snake_set_direction(bench->snake, &player->tail, down);
+	}
+	bench->snake->seed = 1;
+	bench->copy = malloc((size_t)width*height*sizeof(*bench->copy));
+	memcpy(bench->copy, bench->snake->cells, (size_t)width*height*sizeof(*bench->copy));
+	bench->diff = diff_create();
+	snake_commit(bench->snake);
+	snake_next_frame(bench->snake);
+}
+
+void bench_setup_room(bench_t *bench)
+{
+	int i, fds[2];
+
+	bench->daemon = daemon_create(0, 0, bench->players, 10);
+	bench->room.daemon = bench->daemon;
+	bench->room.context = bench->snake;
+	bench->room.size = bench->players;
+	bench->room.nclients = bench->players;
+	bench->room.clients = malloc(bench->players * sizeof(*bench->room.clients));
+	bench->peers = malloc(bench->players * sizeof(*bench->peers));
+	for (i=0;i<bench->players;i++) {
+		socketpair(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK, 0, fds);
+		bench->daemon->client_fd[i] = fds[0];
+		bench->room.clients[i] = i;
+		bench->peers[i] = fds[1];
+	}
+	// every slot is taken, as if all players had connected
+	bench->daemon->nfree = 0;
+}
+
+void bench_teardown(bench_t *bench)
+{
+	int i;
+
+	if (bench->daemon) {
+		for (i=0;i<bench->players;i++) {
+			daemon_disconnect(bench->daemon, i);
+			close(bench->peers[i]);
+		}
+		daemon_destroy(bench->daemon);
+		free(bench->room.clients);
+		free(bench->peers);
+	}
+	strbuf_destroy(bench->sb);
+	free(bench->copy);
+	diff_destroy(bench->diff);
+	snake_destroy(bench->snake);
+}
+
+// every operation returns the number of bytes it produced
+
+int bench_next_frame(bench_t *bench)
+{
+	snake_commit(bench->snake);
+	snake_next_frame(bench->snake);
+	snake_clear_events(bench->snake);
+	return 0;
+}
+
+int bench_get_frame_full(bench_t *bench)
+{
+	strbuf_reset(bench->sb);
+	snake_get_frame(bench->snake, bench->sb, true);
+	return bench->sb->length;
+}
+
+// the written cells keep the difference of the last next frame
+int bench_get_frame_delta(bench_t *bench)
+{
+	strbuf_reset(bench->sb);
+	snake_get_frame(bench->snake, bench->sb, false);
+	return bench->sb->length;
+}
+
+int bench_get_wire_frame_full(bench_t *bench)
+{
+	strbuf_reset(bench->sb);
+	snake_get_wire_frame(bench->snake, bench->sb, true);
+	return bench->sb->length;
+}
+
+int bench_get_wire_frame_delta(bench_t *bench)
+{
+	strbuf_reset(bench->sb);
+	snake_get_wire_frame(bench->snake, bench->sb, false);
+	return bench->sb->length;
+}
+
+// compares the whole board, the result is the same few runs every time
+int bench_diff(bench_t *bench, int kernel)
+{
+	diff_words_with(bench->diff, kernel, bench->snake->cells, bench->copy, bench->width*bench->height, (uint32_t)~SNAKE_TOUCHED);
+	return 0;
+}
+
+int bench_diff_scalar(bench_t *bench)
+{
+	return bench_diff(bench, kernel_scalar);
+}
+
+int bench_diff_sse2(bench_t *bench)
+{
+	return bench_diff(bench, kernel_sse2);
+}
+
+int bench_diff_avx2(bench_t *bench)
+{
+	return bench_diff(bench, kernel_avx2);
+}
+
+// every kernel has to find the runs the scalar one finds, for any length
+// of tail and for boards that do not start on a vector boundary
+bool bench_check_diff()
+{
+	int i, n, offset, density, kernel, boards;
+	uint32_t a[264], b[264];
+	diff_t *scalar, *diff;
+	const char *names[] = { "auto", "scalar", "sse2", "avx2" };
+	bool ok = true;
+
+	scalar = diff_create();
+	diff = diff_create();
+	srand(1);
+	boards = 0;
+	for (n=0;n<=256 && ok;n++) {
+		for (offset=0;offset<8 && ok;offset++) {
+			for (density=1;density<=64 && ok;density*=4) {
+				for (i=0;i<n+offset;i++) {
+					a[i] = b[i] = rand();
+					// some changes are only in the bits that are left out
+					if (rand() % density == 0) {
+						b[i] ^= rand() % 2 ? SNAKE_TOUCHED : 1U << (rand() % 32);
+					}
+				}
+				diff_words_with(scalar, kernel_scalar, a+offset, b+offset, n, (uint32_t)~SNAKE_TOUCHED);
+				for (kernel=kernel_auto;kernel<=kernel_avx2 && ok;kernel++) {
+					if (!diff_supported(kernel)) {
+						continue;
+					}
+					diff_words_with(diff, kernel, a+offset, b+offset, n, (uint32_t)~SNAKE_TOUCHED);
+					if (diff->nruns != scalar->nruns || memcmp(diff->runs, scalar->runs, diff->nruns*sizeof(*diff->runs))) {
+						fprintf(stderr, "diff_%s differs from diff_scalar for %d cells at offset %d\n", names[kernel], n, offset);
+						ok = false;
+					}
+				}
+				boards++;
+			}
+		}
+	}
+	if (ok) {
+		fprintf(stdout, "# diff kernels agree with diff_scalar on %d boards\n", boards);
+	}
+	diff_destroy(diff);
+	diff_destroy(scalar);
+	return ok;
+}
+
+// one append per cell, like a full frame of the board
+int bench_append_literal(bench_t *bench)
+{
+	int i;
+
+	strbuf_reset(bench->sb);
+	for (i=0;i<bench->width*bench->height;i++) {
+		strbuf_append(bench->sb, "\e[0;30;40m  ");
+	}
+	return bench->sb->length;
+}
+
+int bench_append_format(bench_t *bench)
+{
+	int i;
+
+	strbuf_reset(bench->sb);
+	for (i=0;i<bench->width*bench->height;i++) {
+		strbuf_append(bench->sb, "\e[%d;%dH", i / bench->width + 1, i % bench->width * 2 + 1);
+	}
+	return bench->sb->length;
+}
+
+int bench_append_str(bench_t *bench)
+{
+	int i;
+
+	strbuf_reset(bench->sb);
+	for (i=0;i<bench->width*bench->height;i++) {
+		strbuf_append_literal(bench->sb, "\e[0;30;40m  ");
+	}
+	return bench->sb->length;
+}
+
+int bench_append_cursor(bench_t *bench)
+{
+	int i;
+
+	strbuf_reset(bench->sb);
+	for (i=0;i<bench->width*bench->height;i++) {
+		strbuf_append_cursor(bench->sb, i / bench->width + 1, i % bench->width * 2 + 1);
+	}
+	return bench->sb->length;
+}
+
+// includes reading the output back, or the queues would start shedding
+int bench_on_tick(bench_t *bench)
+{
+	int i, n, nbytes;
+	char bytes[65536];
+
+	on_tick(&bench->room, bench->tick);
+	bench->tick = (bench->tick + 1) % 10;
+	nbytes = 0;
+	for (i=0;i<bench->players;i++) {
+		while ((n = read(bench->peers[i], bytes, sizeof(bytes))) > 0) {
+			nbytes += n;
+		}
+	}
+	return nbytes;
+}
+
+// the same room with every client on the binary protocol
+int bench_on_tick_binary(bench_t *bench)
+{
+	int i;
+
+	for (i=0;i<bench->players;i++) {
+		bench->daemon->client_binary[i] = true;
+	}
+	return bench_on_tick(bench);
+}
+
+void bench_report(const char *name, uint64_t ops, double ns, double bytes)
+{
+	int i;
+
+	fprintf(stdout, "%s\t%llu ops\t%.1f ns/op\t%.1f bytes/op", name, (unsigned long long)ops, ns, bytes);
+	for (i=0;i<bench_nbaseline;i++) {
+		if (!strcmp(bench_baseline[i].name, name)) {
+			fprintf(stdout, "\t%+.1f%% ns/op\t%+.1f%% bytes/op",
+					bench_baseline[i].ns ? (ns / bench_baseline[i].ns - 1) * 100 : 0.0,
+					bench_baseline[i].bytes ? (bytes / bench_baseline[i].bytes - 1) * 100 : 0.0);
+			break;
+		}
+	}
+	fprintf(stdout, "\n");
+	fflush(stdout);
+}
+
+// double the number of operations until a run takes long enough
+double bench_measure(bench_t *bench, const char *name, int (*op)(bench_t *bench))
+{
+	uint64_t i, n, start, elapsed, bytes;
+
+	n = 1;
+	for (;;) {
+		bytes = 0;
+		start = bench_clock();
+		for (i=0;i<n;i++) {
+			bytes += op(bench);
+		}
+		elapsed = bench_clock() - start;
+		if (elapsed >= BENCH_TIME || elapsed * 2 >= BENCH_MAX_OP) {
+			break;
+		}
+		n *= 2;
+	}
+	bench_report(name, n, (double)elapsed / n, (double)bytes / n);
+	return (double)elapsed / n;
+}
+
+// cost grows like cells to the power seen between the last two sizes,
+// quadratic until there are two sizes, to skip what would take too long
+void bench_run(const char *name, int (*op)(bench_t *bench), bool room, int *players)
+{
+	int i, j;
+	char label[128];
+	double ns, cells, estimate, power, last_ns, last_cells;
+	bench_t bench;
+	int sizes[][2] = { {40,20}, {256,128}, {1024,1024}, {4096,4096} };
+
+	for (j=0;players[j];j++) {
+		last_ns = last_cells = 0;
+		power = 2;
+		for (i=0;i<(int)(sizeof(sizes)/sizeof(sizes[0]));i++) {
+			snprintf(label, sizeof(label), "%s/%dx%d/%d", name, sizes[i][0], sizes[i][1], players[j]);
+			cells = (double)sizes[i][0] * sizes[i][1];
+			estimate = last_ns * pow(cells / last_cells, power);
+			if (last_ns && estimate > BENCH_MAX_OP) {
+				fprintf(stdout, "# %s skipped, estimated %.1f s/op\n", label, estimate / 1e9);
+				break;
+			}
+			bench_setup(&bench, sizes[i][0], sizes[i][1], players[j]);
+			if (room) {
+				bench_setup_room(&bench);
+			}
+			ns = bench_measure(&bench, label, op);
+			bench_teardown(&bench);
+			if (last_ns) {
+				power = log(ns / last_ns) / log(cells / last_cells);
+				power = power < 1 ? 1 : power;
+			}
+			last_ns = ns;
+			last_cells = cells;
+		}
+	}
+}
+
+bool bench_load(const char *filename)
+{
+	int size;
+	char line[512];
+	FILE *file;
+	bench_result_t result;
+
+	file = fopen(filename, "r");
+	if (!file) {
+		return false;
+	}
+	size = 0;
+	while (fgets(line, sizeof(line), file)) {
+		if (sscanf(line, "%127s %*u ops %lf ns/op %lf bytes/op", result.name, &result.ns, &result.bytes) != 3) {
+			continue;
+		}
+		if (bench_nbaseline == size) {
+			size = size ? size * 2 : 64;
+			bench_baseline = realloc(bench_baseline, size * sizeof(*bench_baseline));
+		}
+		bench_baseline[bench_nbaseline++] = result;
+	}
+	fclose(file);
+	return true;
+}
+
+int main(int argc, char ** argv)
+{
+	int players[] = { 2, 8, 0 };
+	int single[] = { 2, 0 };
+
+	if (argc > 2 || (argc == 2 && !strcmp(argv[1], "-h"))) {
+		fprintf(stderr, "Usage: %s [baseline]\n",argv[0]);
+		return EXIT_FAILURE;
+	}
+	// compare against the output of an earlier run
+	if (argc == 2 && !bench_load(argv[1])) {
+		fprintf(stderr, "Could not read baseline %s\n",argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	if (!bench_check_diff()) {
+		return EXIT_FAILURE;
+	}
+	bench_run("snake_next_frame", bench_next_frame, false, players);
+	bench_run("snake_get_frame_full", bench_get_frame_full, false, players);
+	bench_run("snake_get_frame_delta", bench_get_frame_delta, false, players);
+	bench_run("snake_get_wire_frame_full", bench_get_wire_frame_full, false, players);
+	bench_run("snake_get_wire_frame_delta", bench_get_wire_frame_delta, false, players);
+	bench_run("diff_scalar", bench_diff_scalar, false, single);
+	if (diff_supported(kernel_sse2)) {
+		bench_run("diff_sse2", bench_diff_sse2, false, single);
+	}
+	if (diff_supported(kernel_avx2)) {
+		bench_run("diff_avx2", bench_diff_avx2, false, single);
+	}
+	bench_run("strbuf_append_literal", bench_append_literal, false, single);
+	bench_run("strbuf_append_format", bench_append_format, false, single);
+	bench_run("strbuf_append_str", bench_append_str, false, single);
+	bench_run("strbuf_append_cursor", bench_append_cursor, false, single);
+	bench_run("on_tick", bench_on_tick, true, players);
+	bench_run("on_tick_binary", bench_on_tick_binary, true, players);
+
+	free(bench_baseline);
+	return EXIT_SUCCESS;
+}
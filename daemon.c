@@ -6,196 +6,2636 @@
  URL         : https://github.com/mevdschee/daemon-games
  ============================================================================
  */
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 
 #include "daemon.h"
 
+// io_uring rings are mapped directly, so liburing is not required
+#define DAEMON_URING_ENTRIES 4096
+#define DAEMON_URING_BUFFERS 1024
+#define DAEMON_URING_BUFSIZE 2048
+
+// frames gathered into one send
+#define DAEMON_IOV 16
+
+enum daemon_uring_ops { uring_accept, uring_recv, uring_send, uring_timeout, uring_cancel };
+
+// descriptors sent in one message, the kernel takes at most 253
+#define DAEMON_HANDOFF_FDS 250
+
+// seconds the processes wait for each other during an upgrade
+#define DAEMON_HANDOFF_TIMEOUT 10
+
+// holds the socket to the old process in one that was started to take over
+#define DAEMON_HANDOFF_ENV "DAEMON_HANDOFF"
+
+typedef struct daemon_uring_client_t daemon_uring_client_t;
+
+// a slot is only reused once all its requests have completed
+struct daemon_uring_client_t {
+	int inflight;
+	bool pending;
+	int nsending;
+	daemon_frame_t *sending[DAEMON_IOV];
+	struct iovec iov[DAEMON_IOV];
+	struct msghdr msg;
+};
+
+struct daemon_uring_t {
+	int fd;
+	void *ring;
+	size_t ring_size;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	unsigned nsubmit;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	struct io_uring_cqe *cqes;
+	// receive buffers the kernel picks from
+	struct io_uring_buf_ring *buf_ring;
+	size_t buf_ring_size;
+	uint16_t buf_tail;
+	char *buffers;
+	struct __kernel_timespec timeout;
+	bool timeout_armed;
+	int naccepts;
+	bool lost_accept[2];
+	// set while the requests are cancelled for a handoff
+	bool stopping;
+	bool cancelling;
+	// clients to resync once their dropped backlog has drained
+	int npending;
+	int *pending;
+	daemon_uring_client_t *clients;
+};
+
+// a thread answering scrapes, it reads the counters of all shards while
+// they update them, so a snapshot may be off by an event
+typedef struct daemon_metrics_t daemon_metrics_t;
+
+struct daemon_metrics_t {
+	int fd;
+	int nshards;
+	daemon_t **shards;
+	pthread_t thread;
+};
+
+// what a shard hands over, the bytes go in a memfd and the descriptors
+// are sent along with it
+struct daemon_state_t {
+	FILE *file;
+	int *fds;
+	int nfds;
+	int size;
+	int next;
+	bool failed;
+};
+
+enum daemon_handoff_states { handoff_idle, handoff_saving, handoff_done };
+
+// the thread that takes the upgrade signal starts the new process, every
+// shard saves after its next tick and waits until the new process took
+// over or failed to, a new process receives all of it before it starts
+struct daemon_handoff_t {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int state;
+	// shards that saved, or in the new process that loaded their state
+	int nready;
+	bool failed;
+	int nshards;
+	daemon_t **shards;
+	daemon_state_t *states;
+	// socket to the other process, -1 while there is none
+	int fd;
+	bool adopting;
+	bool running;
+	pthread_t thread;
+};
+
+// the first message of a new process, the old one only stops for it when
+// it can read what is saved and has the same shards and slots
+typedef struct daemon_hello_t daemon_hello_t;
+
+struct daemon_hello_t {
+	uint32_t version;
+	uint32_t shards;
+	uint32_t slots;
+};
+
+// counters that go on in the new process, so the metrics do not restart
+static const size_t daemon_saved_counters[] = {
+	offsetof(daemon_t, ticks_missed), offsetof(daemon_t, tick_time), offsetof(daemon_t, wakeups),
+	offsetof(daemon_t, accepted), offsetof(daemon_t, refused), offsetof(daemon_t, dropped),
+	offsetof(daemon_t, disconnected), offsetof(daemon_t, bytes_sent), offsetof(daemon_t, frames_sent),
+	offsetof(daemon_t, tick_count)
+};
+
+// upper bounds of the tick duration buckets, in nanoseconds
+static const uint64_t daemon_tick_bounds[DAEMON_TICK_BUCKETS] = {
+	100000, 250000, 1000000, 2500000, 10000000, 25000000, 100000000
+};
+
+// epoll user data holds both fd and slot, so a stale event for a slot that
+// was disconnected and reused within the same batch can be recognized
+uint64_t daemon_event_data(int fd, uint32_t slot)
+{
+	return ((uint64_t)(uint32_t)fd << 32) | slot;
+}
+
+daemon_frame_t *daemon_frame_create(char *bytes, int nbytes)
+{
+	daemon_frame_t *frame;
+
+	frame = malloc(sizeof(*frame) + nbytes);
+	frame->refs = 1;
+	frame->id = 0;
+	frame->nbytes = nbytes;
+	memcpy(frame->bytes, bytes, nbytes);
+	return frame;
+}
+
+void daemon_frame_release(daemon_frame_t *frame)
+{
+	if (--frame->refs == 0) {
+		free(frame);
+	}
+}
+
+daemon_frame_t *daemon_ring_get(daemon_ring_t *ring, int i)
+{
+	return ring->frames[(ring->first + i) & (ring->size - 1)];
+}
+
+// the ring size is a power of two and doubles when it is full
+void daemon_ring_push(daemon_ring_t *ring, daemon_frame_t *frame)
+{
+	int i, size;
+	daemon_frame_t **frames;
+
+	if (ring->count == ring->size) {
+		size = ring->size ? ring->size * 2 : 8;
+		frames = malloc(size * sizeof(*frames));
+		for (i=0;i<ring->count;i++) {
+			frames[i] = daemon_ring_get(ring, i);
+		}
+		free(ring->frames);
+		ring->frames = frames;
+		ring->size = size;
+		ring->first = 0;
+	}
+	ring->frames[(ring->first + ring->count++) & (ring->size - 1)] = frame;
+}
+
+daemon_frame_t *daemon_ring_shift(daemon_ring_t *ring)
+{
+	daemon_frame_t *frame;
+
+	frame = daemon_ring_get(ring, 0);
+	ring->first = (ring->first + 1) & (ring->size - 1);
+	ring->count--;
+	return frame;
+}
+
+void daemon_ring_clear(daemon_ring_t *ring)
+{
+	while (ring->count) {
+		daemon_frame_release(daemon_ring_shift(ring));
+	}
+	free(ring->frames);
+	memset(ring,0,sizeof(*ring));
+}
+
+void daemon_queue_clear(daemon_queue_t *queue)
+{
+	daemon_ring_clear(&queue->frames);
+	daemon_ring_clear(&queue->zerocopy_frames);
+	memset(queue,0,sizeof(*queue));
+}
+
+// gather queued frames into an iovec, the first one from its offset
+int daemon_queue_iov(daemon_queue_t *queue, struct iovec *iov, int max)
+{
+	int i;
+	daemon_frame_t *frame;
+
+	for (i=0;i<queue->frames.count && i<max;i++) {
+		frame = daemon_ring_get(&queue->frames, i);
+		iov[i].iov_base = frame->bytes + (i ? 0 : queue->offset);
+		iov[i].iov_len = frame->nbytes - (i ? 0 : queue->offset);
+	}
+	return i;
+}
+
+bool daemon_uring_submit(daemon_uring_t *uring, unsigned wait)
+{
+	int result;
+
+	result = syscall(__NR_io_uring_enter, uring->fd, uring->nsubmit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (result < 0) {
+		return false;
+	}
+	uring->nsubmit -= result;
+	return true;
+}
+
+struct io_uring_sqe *daemon_uring_sqe(daemon_uring_t *uring, int op, uint32_t slot)
+{
+	unsigned tail, index;
+	struct io_uring_sqe *sqe;
+
+	tail = *uring->sq_tail;
+	// submission queue is full, hand it to the kernel first, when it takes
+	// nothing (busy with a full completion queue) the caller gives up
+	if (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) > *uring->sq_mask) {
+		if (!daemon_uring_submit(uring, 0) || tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) > *uring->sq_mask) {
+			return NULL;
+		}
+	}
+	index = tail & *uring->sq_mask;
+	sqe = &uring->sqes[index];
+	memset(sqe,0,sizeof(*sqe));
+	sqe->user_data = ((uint64_t)op << 32) | slot;
+	uring->sq_array[index] = index;
+	__atomic_store_n(uring->sq_tail, tail+1, __ATOMIC_RELEASE);
+	uring->nsubmit++;
+	return sqe;
+}
+
+// false when it could not be queued, the caller disconnects the client
+bool daemon_uring_recv(daemon_t *daemon, int client)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = daemon_uring_sqe(daemon->uring, uring_recv, client);
+	if (!sqe) {
+		return false;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = daemon->client_fd[client];
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	daemon->uring->clients[client].inflight++;
+	return true;
+}
+
+// the slot of an accept is 1 for the watch port
+void daemon_uring_accept(daemon_t *daemon, bool spectator)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = daemon_uring_sqe(daemon->uring, uring_accept, spectator);
+	if (!sqe) {
+		// tried again on the next loop
+		daemon->uring->lost_accept[spectator] = true;
+		return;
+	}
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = spectator ? daemon->watch_fd : daemon->server_fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK|SOCK_CLOEXEC;
+	daemon->uring->naccepts++;
+}
+
+// one sendmsg covering the first queued frames, the iovec and the frames
+// must outlive the request, a send that cannot be queued disconnects
+void daemon_uring_send(daemon_t *daemon, int client)
+{
+	int i;
+	struct io_uring_sqe *sqe;
+	daemon_queue_t *queue = &daemon->client_queue[client];
+	daemon_uring_client_t *state = &daemon->uring->clients[client];
+
+	sqe = daemon_uring_sqe(daemon->uring, uring_send, client);
+	if (!sqe) {
+		daemon_disconnect(daemon, client);
+		return;
+	}
+	state->nsending = daemon_queue_iov(queue, state->iov, DAEMON_IOV);
+	for (i=0;i<state->nsending;i++) {
+		state->sending[i] = daemon_ring_get(&queue->frames, i);
+		state->sending[i]->refs++;
+	}
+	memset(&state->msg,0,sizeof(state->msg));
+	state->msg.msg_iov = state->iov;
+	state->msg.msg_iovlen = state->nsending;
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = daemon->client_fd[client];
+	sqe->addr = (uint64_t)(uintptr_t)&state->msg;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	state->inflight++;
+}
+
+// the last completion of a disconnected client frees its slot
+void daemon_uring_done(daemon_t *daemon, int client)
+{
+	if (--daemon->uring->clients[client].inflight == 0 && daemon->client_fd[client] < 0) {
+		daemon->free_slots[daemon->nfree++] = client;
+	}
+}
+
+// ends the multishot receive, frames being sent hold their own reference
+void daemon_uring_release(daemon_t *daemon, int client)
+{
+	shutdown(daemon->client_fd[client], SHUT_RDWR);
+}
+
+// only ask for writability while there is something queued
+void daemon_want_write(daemon_t *daemon, int client, bool enable)
+{
+	struct epoll_event event;
+	daemon_uring_t *uring = daemon->uring;
+
+	// io_uring has one send in flight per client, its completion sends the
+	// rest, and all of them are submitted together once per loop
+	if (uring) {
+		if (!enable || uring->clients[client].nsending || uring->stopping) {
+			return;
+		}
+		if (daemon->client_queue[client].frames.count) {
+			daemon_uring_send(daemon, client);
+		} else if (!uring->clients[client].pending) {
+			uring->clients[client].pending = true;
+			uring->pending[uring->npending++] = client;
+		}
+		return;
+	}
+	if (daemon->epoll_fd < 0) {
+		return;
+	}
+	event.events = enable ? EPOLLIN|EPOLLOUT : EPOLLIN;
+	event.data.u64 = daemon_event_data(daemon->client_fd[client], client);
+	epoll_ctl(daemon->epoll_fd, EPOLL_CTL_MOD, daemon->client_fd[client], &event);
+}
+
 void daemon_disconnect(daemon_t *daemon, int client)
 {
+	if (daemon->client_fd[client] < 0) {
+		return;
+	}
+	if (daemon->uring) {
+		daemon_uring_release(daemon, client);
+	}
+	// closing the last reference also removes the fd from the epoll set
 	close(daemon->client_fd[client]);
 	daemon->client_fd[client] = -1;
+	daemon->disconnected++;
+	daemon->bytes_sent += daemon->client_queue[client].bytes_sent;
+	daemon->frames_sent += daemon->client_queue[client].frames_sent;
+	daemon_queue_clear(&daemon->client_queue[client]);
+	memset(&daemon->client_input[client],0,sizeof(daemon->client_input[client]));
+	if (!daemon->uring || !daemon->uring->clients[client].inflight) {
+		daemon->free_slots[daemon->nfree++] = client;
+	}
 	daemon->on_disconnect(daemon, client);
 }
 
-int daemon_read(daemon_t *daemon, int client, char *bytes, int nbytes)
+// copy into the input ring what fits, the rest of a flood is dropped
+int daemon_input_push(daemon_input_t *input, char *bytes, int nbytes)
+{
+	int i, start;
+
+	if (nbytes > DAEMON_INPUT - input->count) {
+		nbytes = DAEMON_INPUT - input->count;
+	}
+	start = input->first + input->count;
+	for (i=0;i<nbytes;i++) {
+		input->bytes[(start + i) & (DAEMON_INPUT - 1)] = bytes[i];
+	}
+	input->count += nbytes;
+	return nbytes;
+}
+
+// one read per wakeup into the free part of the input ring, true when
+// there are new bytes for on_data
+bool daemon_receive(daemon_t *daemon, int client)
+{
+	int result, start, space, n;
+	struct iovec iov[2];
+	char discard[DAEMON_INPUT];
+	daemon_input_t *input = &daemon->client_input[client];
+
+	start = (input->first + input->count) & (DAEMON_INPUT - 1);
+	space = DAEMON_INPUT - input->count;
+	n = 1;
+	if (space) {
+		iov[0].iov_base = input->bytes + start;
+		iov[0].iov_len = space < DAEMON_INPUT - start ? space : DAEMON_INPUT - start;
+		iov[1].iov_base = input->bytes;
+		iov[1].iov_len = space - iov[0].iov_len;
+		n = iov[1].iov_len ? 2 : 1;
+	} else {
+		// the ring is full, a read still has to happen or the loop would spin
+		iov[0].iov_base = discard;
+		iov[0].iov_len = sizeof(discard);
+	}
+	result = readv(daemon->client_fd[client], iov, n);
+	if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return false;
+	}
+	if (result <= 0) {
+		daemon_disconnect(daemon,client);
+		return false;
+	}
+	if (!space) {
+		return false;
+	}
+	input->count += result;
+	return true;
+}
+
+// consume received bytes, input that is not read stays for a later call
+int daemon_read(daemon_t *daemon, int client, char *bytes, int nbytes)
+{
+	int i;
+	daemon_input_t *input = &daemon->client_input[client];
+
+	if (daemon->client_fd[client] < 0) {
+		return -1;
+	}
+	if (nbytes > input->count) {
+		nbytes = input->count;
+	}
+	for (i=0;i<nbytes;i++) {
+		bytes[i] = input->bytes[(input->first + i) & (DAEMON_INPUT - 1)];
+	}
+	input->first = (input->first + nbytes) & (DAEMON_INPUT - 1);
+	input->count -= nbytes;
+	return nbytes;
+}
+
+// the kernel reports finished zero copy sends as ranges on the error queue
+void daemon_reap_zerocopy(daemon_t *daemon, int client)
+{
+	char control[128];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct sock_extended_err *error;
+	daemon_queue_t *queue = &daemon->client_queue[client];
+
+	while (queue->zerocopy_frames.count) {
+		memset(&msg,0,sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(daemon->client_fd[client], &msg, MSG_ERRQUEUE) < 0) {
+			return;
+		}
+		for (cmsg=CMSG_FIRSTHDR(&msg);cmsg;cmsg=CMSG_NXTHDR(&msg,cmsg)) {
+			if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR) {
+				continue;
+			}
+			error = (struct sock_extended_err *)CMSG_DATA(cmsg);
+			if (error->ee_origin != SO_EE_ORIGIN_ZEROCOPY || error->ee_errno) {
+				continue;
+			}
+			while (queue->zerocopy_frames.count && (int32_t)(error->ee_data - queue->zerocopy_seq) >= 0) {
+				daemon_frame_release(daemon_ring_shift(&queue->zerocopy_frames));
+				queue->zerocopy_seq++;
+			}
+		}
+	}
+}
+
+// one sendmsg for as many frames as fit, a large frame goes alone and
+// without a copy, it stays referenced until the kernel is done with it
+int daemon_send_queue(daemon_t *daemon, int client, int *nbytes)
+{
+	int i, n, flags, result;
+	struct msghdr msg;
+	struct iovec iov[DAEMON_IOV];
+	daemon_frame_t *frame;
+	daemon_queue_t *queue = &daemon->client_queue[client];
+
+	if (queue->zerocopy_frames.count) {
+		daemon_reap_zerocopy(daemon, client);
+	}
+	n = daemon_queue_iov(queue, iov, DAEMON_IOV);
+	flags = MSG_NOSIGNAL;
+	frame = daemon_ring_get(&queue->frames, 0);
+	if (queue->zerocopy) {
+		if (frame->nbytes >= (int)daemon->zerocopy_min) {
+			n = 1;
+			flags |= MSG_ZEROCOPY;
+		}
+		for (i=1;i<n;i++) {
+			if (daemon_ring_get(&queue->frames, i)->nbytes >= (int)daemon->zerocopy_min) {
+				n = i;
+			}
+		}
+	}
+	memset(&msg,0,sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n;
+	*nbytes = 0;
+	for (i=0;i<n;i++) {
+		*nbytes += iov[i].iov_len;
+	}
+	result = sendmsg(daemon->client_fd[client], &msg, flags);
+	// out of pinned memory for zero copy, an ordinary send still works
+	if (result < 0 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+		flags &= ~MSG_ZEROCOPY;
+		result = sendmsg(daemon->client_fd[client], &msg, flags);
+	}
+	if (result > 0 && (flags & MSG_ZEROCOPY)) {
+		frame->refs++;
+		daemon_ring_push(&queue->zerocopy_frames, frame);
+	}
+	return result;
+}
+
+// drop the frames that were sent completely
+void daemon_queue_advance(daemon_queue_t *queue, int nbytes)
+{
+	daemon_frame_t *frame;
+
+	queue->nbytes -= nbytes;
+	queue->bytes_sent += nbytes;
+	while (nbytes > 0) {
+		frame = daemon_ring_get(&queue->frames, 0);
+		if (nbytes < frame->nbytes - queue->offset) {
+			queue->offset += nbytes;
+			return;
+		}
+		nbytes -= frame->nbytes - queue->offset;
+		queue->offset = 0;
+		queue->frames_sent++;
+		if (frame->id) {
+			queue->last_frame = frame->id;
+		}
+		daemon_frame_release(daemon_ring_shift(&queue->frames));
+	}
+}
+
+// write as much of the queue as the socket takes, false on a broken client
+bool daemon_flush(daemon_t *daemon, int client)
+{
+	int result, nbytes;
+	daemon_queue_t *queue = &daemon->client_queue[client];
+
+	while (queue->frames.count) {
+		result = daemon_send_queue(daemon, client, &nbytes);
+		if (result < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return true;
+			}
+			daemon_disconnect(daemon,client);
+			return false;
+		}
+		daemon_queue_advance(queue, result);
+		if (result < nbytes) {
+			return true;
+		}
+	}
+	daemon_want_write(daemon, client, false);
+	// the backlog is gone, let the game repaint what was dropped
+	if (queue->resync) {
+		queue->resync = false;
+		daemon->on_resync(daemon, client);
+	}
+	return true;
+}
+
+// drop everything that has not started sending, a partially sent frame
+// must complete or the terminal would see half an escape sequence
+void daemon_shed(daemon_t *daemon, int client)
+{
+	int i, keep;
+	daemon_queue_t *queue = &daemon->client_queue[client];
+
+	keep = queue->offset ? 1 : 0;
+	if (daemon->uring && daemon->uring->clients[client].nsending > keep) {
+		keep = daemon->uring->clients[client].nsending;
+	}
+	while (queue->frames.count > keep) {
+		queue->frames.count--;
+		daemon_frame_release(daemon_ring_get(&queue->frames, queue->frames.count));
+	}
+	queue->nbytes = -queue->offset;
+	for (i=0;i<keep;i++) {
+		queue->nbytes += daemon_ring_get(&queue->frames, i)->nbytes;
+	}
+	if (!queue->resync) {
+		queue->resync = true;
+		queue->resync_tick = daemon->tick_count;
+	}
+}
+
+// a lagging client gets no new output until it drained its backlog
+int daemon_write_check(daemon_t *daemon, int client)
+{
+	daemon_queue_t *queue = &daemon->client_queue[client];
+
+	if (daemon->client_fd[client] < 0) {
+		return -1;
+	}
+	if (queue->resync) {
+		if (daemon->tick_count - queue->resync_tick > daemon->evict_ticks) {
+			fprintf(stderr, "client %d evicted, too slow\n", client);
+			daemon_disconnect(daemon,client);
+			return -1;
+		}
+		return 0;
+	}
+	return 1;
+}
+
+// queue a reference to the frame, optionally trying to send right away
+int daemon_enqueue(daemon_t *daemon, int client, daemon_frame_t *frame, bool send_now)
+{
+	int result, nbytes;
+	bool queued;
+	daemon_queue_t *queue = &daemon->client_queue[client];
+
+	queued = queue->frames.count > 0;
+	frame->refs++;
+	daemon_ring_push(&queue->frames, frame);
+	queue->nbytes += frame->nbytes;
+	if (!queued && send_now && !daemon->uring) {
+		result = daemon_send_queue(daemon, client, &nbytes);
+		if (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			daemon_disconnect(daemon,client);
+			return -1;
+		}
+		if (result > 0) {
+			daemon_queue_advance(queue, result);
+		}
+		if (!queue->frames.count) {
+			return frame->nbytes;
+		}
+	}
+	if (!queued) {
+		daemon_want_write(daemon, client, true);
+		if (daemon->client_fd[client] < 0) {
+			return -1;
+		}
+	}
+	if ((uint32_t)queue->nbytes > daemon->queue_limit) {
+		daemon_shed(daemon, client);
+	}
+	return frame->nbytes;
+}
+
+int daemon_write(daemon_t *daemon, int client, char *bytes, int nbytes)
+{
+	int result;
+	daemon_frame_t *frame;
+	daemon_queue_t *queue = &daemon->client_queue[client];
+
+	result = daemon_write_check(daemon, client);
+	if (result <= 0) {
+		return result;
+	}
+	// nothing queued, so the bytes only need a copy if the socket is full
+	result = 0;
+	if (!queue->frames.count && !daemon->uring) {
+		result = send(daemon->client_fd[client], bytes, nbytes, MSG_NOSIGNAL);
+		if (result < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				daemon_disconnect(daemon,client);
+				return -1;
+			}
+			result = 0;
+		}
+		queue->bytes_sent += result;
+		if (result == nbytes) {
+			queue->frames_sent++;
+			return nbytes;
+		}
+	}
+	frame = daemon_frame_create(bytes + result, nbytes - result);
+	result = daemon_enqueue(daemon, client, frame, false);
+	daemon_frame_release(frame);
+	return result < 0 ? -1 : nbytes;
+}
+
+int daemon_write_frame(daemon_t *daemon, int client, daemon_frame_t *frame)
+{
+	int result;
+
+	result = daemon_write_check(daemon, client);
+	if (result <= 0) {
+		return result;
+	}
+	return daemon_enqueue(daemon, client, frame, true);
+}
+
+// what the client has on screen, so a resync can send only what it missed
+uint64_t daemon_last_frame(daemon_t *daemon, int client)
+{
+	return daemon->client_queue[client].last_frame;
+}
+
+// the frame is shared by all queues, negative clients are skipped
+void daemon_broadcast(daemon_t *daemon, daemon_frame_t *frame, int *clients, int nclients)
+{
+	int i;
+
+	for (i=0;i<nclients;i++) {
+		if (clients[i] >= 0) {
+			daemon_write_frame(daemon, clients[i], frame);
+		}
+	}
+}
+
+void daemon_save(daemon_state_t *state, const void *bytes, size_t nbytes)
+{
+	if (nbytes && fwrite(bytes, nbytes, 1, state->file) != 1) {
+		state->failed = true;
+	}
+}
+
+bool daemon_load(daemon_state_t *state, void *bytes, size_t nbytes)
+{
+	if (state->failed || (nbytes && fread(bytes, nbytes, 1, state->file) != 1)) {
+		state->failed = true;
+		return false;
+	}
+	return true;
+}
+
+// the descriptor stays open here, the new process gets a copy of it
+void daemon_save_fd(daemon_state_t *state, int fd)
+{
+	if (state->nfds == state->size) {
+		state->size = state->size ? state->size * 2 : 64;
+		state->fds = realloc(state->fds, state->size * sizeof(*state->fds));
+	}
+	state->fds[state->nfds++] = fd;
+}
+
+int daemon_load_fd(daemon_state_t *state)
+{
+	if (state->failed || state->next == state->nfds) {
+		state->failed = true;
+		return -1;
+	}
+	return state->fds[state->next++];
+}
+
+int daemon_listen_port(daemon_t *daemon, uint16_t port, struct sockaddr_in *address)
+{
+	int fd, value;
+
+	// a new process gets the listener sent, it must not inherit it as well
+	fd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		fprintf(stderr, "Could not create socket\n");
+		return -1;
+	}
+
+	value = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value)) < 0) {
+		fprintf(stderr, "Could not set socket reuse option\n");
+		close(fd);
+		return -1;
+	}
+
+	// shards bind the same port and the kernel spreads connections over them
+	if (daemon->shards > 1 && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value)) < 0) {
+		fprintf(stderr, "Could not set socket reuseport option\n");
+		close(fd);
+		return -1;
+	}
+
+	memset(address, 0 ,sizeof(*address));
+	address->sin_family = AF_INET;
+	address->sin_port = htons(port);
+	address->sin_addr.s_addr = htonl(daemon->ip);
+
+	if (bind(fd, (const struct sockaddr *)address, sizeof(*address)) < 0) {
+		fprintf(stderr, "Could not bind socket\n");
+		close(fd);
+		return -1;
+	}
+
+	if (listen(fd, daemon->backlog) < 0){
+		fprintf(stderr, "Could not listen on socket\n");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+bool daemon_listen(daemon_t *daemon)
+{
+	struct rlimit limit;
+	struct sockaddr_in address;
+
+	// every slot of every shard needs a descriptor, so raise the soft limit if we can
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)daemon->slots * daemon->shards + 16) {
+		limit.rlim_cur = (rlim_t)daemon->slots * daemon->shards + 16;
+		if (limit.rlim_cur > limit.rlim_max) {
+			limit.rlim_cur = limit.rlim_max;
+		}
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	daemon->server_fd = daemon_listen_port(daemon, daemon->port, &daemon->server_address);
+	if (daemon->server_fd < 0) {
+		return false;
+	}
+	if (daemon->watch_port) {
+		daemon->watch_fd = daemon_listen_port(daemon, daemon->watch_port, &address);
+		if (daemon->watch_fd < 0) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// nanoseconds on a clock that wall-clock adjustments cannot move
+uint64_t daemon_clock()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void daemon_set_timeout(daemon_t *daemon, struct timeval *timeout)
+{
+	uint64_t now, usec;
+
+	now = daemon_clock();
+	usec = 0;
+	// round up, waking early would only spin until the tick is due
+	if (daemon->next_tick > now) {
+		usec = (daemon->next_tick - now + 999) / 1000;
+	}
+	timeout->tv_sec = usec / 1000000;
+	timeout->tv_usec = usec % 1000000;
+}
+
+void daemon_destroy(daemon_t *daemon)
+{
+	free(daemon->events);
+	free(daemon->free_slots);
+	free(daemon->client_queue);
+	free(daemon->client_input);
+	free(daemon->client_address);
+	free(daemon->client_spectator);
+	free(daemon->client_binary);
+	free(daemon->client_fd);
+	free(daemon);
+}
+
+// a cheap notice instead of a silent close, the socket buffer is still empty
+void daemon_refuse(daemon_t *daemon, int fd, const char *reason)
+{
+	static const char message[] = "Server full, try again later\r\n";
+
+	send(fd, message, sizeof(message)-1, MSG_NOSIGNAL|MSG_DONTWAIT);
+	close(fd);
+	daemon->refused++;
+	fprintf(stderr, "client denied, %s\n", reason);
+}
+
+void daemon_add_client(daemon_t *daemon, int fd, struct sockaddr_in *address, bool spectator)
+{
+	int i, value;
+	bool armed;
+	struct epoll_event event;
+
+	if (!daemon->nfree) {
+		daemon_refuse(daemon, fd, "max clients reached");
+		return;
+	}
+	if (daemon->epoll_fd < 0 && !daemon->uring && fd >= FD_SETSIZE) {
+		daemon_refuse(daemon, fd, "descriptor exceeds FD_SETSIZE");
+		return;
+	}
+
+	i = daemon->free_slots[--daemon->nfree];
+	if (daemon->epoll_fd >= 0) {
+		event.events = EPOLLIN;
+		event.data.u64 = daemon_event_data(fd, i);
+		if (epoll_ctl(daemon->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+			daemon->free_slots[daemon->nfree++] = i;
+			close(fd);
+			daemon->dropped++;
+			fprintf(stderr, "Could not add client to epoll\n");
+			return;
+		}
+	}
+	// io_uring sends from its own iovecs, zero copy is for sendmsg only
+	if (daemon->zerocopy_min && !daemon->uring) {
+		value = 1;
+		daemon->client_queue[i].zerocopy = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &value, sizeof(value)) == 0;
+	}
+	daemon->accepted++;
+	daemon->client_address[i] = *address;
+	daemon->client_spectator[i] = spectator;
+	daemon->client_binary[i] = false;
+	daemon->client_fd[i] = fd;
+	// a client that comes in while stopping receives once the loop goes on
+	armed = !daemon->uring || daemon->uring->stopping || daemon_uring_recv(daemon, i);
+	daemon->on_connect(daemon,i);
+	if (!armed) {
+		daemon_disconnect(daemon, i);
+	}
+}
+
+// receive from a client that was handed over or stopped for a handoff, and
+// send what it was not sent yet
+void daemon_resume_client(daemon_t *daemon, int client)
+{
+	struct epoll_event event;
+	daemon_queue_t *queue = &daemon->client_queue[client];
+
+	if (daemon->epoll_fd >= 0) {
+		event.events = EPOLLIN;
+		event.data.u64 = daemon_event_data(daemon->client_fd[client], client);
+		if (epoll_ctl(daemon->epoll_fd, EPOLL_CTL_ADD, daemon->client_fd[client], &event) < 0) {
+			fprintf(stderr, "Could not add client to epoll\n");
+			daemon_disconnect(daemon, client);
+			return;
+		}
+	} else if (!daemon->uring && daemon->client_fd[client] >= FD_SETSIZE) {
+		fprintf(stderr, "client dropped, descriptor exceeds FD_SETSIZE\n");
+		daemon_disconnect(daemon, client);
+		return;
+	}
+	if (daemon->uring && !daemon_uring_recv(daemon, client)) {
+		daemon_disconnect(daemon, client);
+		return;
+	}
+	if (queue->frames.count || queue->resync) {
+		daemon_want_write(daemon, client, true);
+	}
+}
+
+// drain the backlog, but leave room for ticks when a storm keeps coming
+void daemon_accept(daemon_t *daemon, int server_fd)
+{
+	int fd;
+	uint32_t n;
+	socklen_t len;
+	struct sockaddr_in address;
+
+	for (n=0;n<daemon->accept_budget;n++) {
+		memset(&address, 0 ,sizeof(address));
+		len = sizeof(address);
+		// a slow client must never block the loop
+		fd = accept4(server_fd, (struct sockaddr *)&address, &len, SOCK_NONBLOCK|SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return;
+			}
+			// the peer gave up while waiting in the backlog
+			if (errno == ECONNABORTED || errno == EINTR) {
+				daemon->dropped += errno == ECONNABORTED;
+				continue;
+			}
+			fprintf(stderr, "accept failed\n");
+			return;
+		}
+		daemon_add_client(daemon, fd, &address, server_fd == daemon->watch_fd);
+	}
+}
+
+void daemon_tick(daemon_t *daemon, int *tick)
+{
+	int i;
+	uint64_t start, duration;
+
+	start = daemon_clock();
+	daemon->on_tick(daemon,*tick);
+	duration = daemon_clock() - start;
+	daemon->tick_time += duration;
+	for (i=0;i<DAEMON_TICK_BUCKETS;i++) {
+		if (duration <= daemon_tick_bounds[i]) {
+			daemon->tick_buckets[i]++;
+			break;
+		}
+	}
+	*tick = (*tick+1) % daemon->ticks;
+	daemon->tick_count++;
+}
+
+// fire every tick that is due, whatever woke the loop up
+void daemon_tick_due(daemon_t *daemon, int *tick)
+{
+	uint64_t now, missed;
+	int64_t diff;
+	uint32_t n;
+
+	now = daemon_clock();
+	if (now < daemon->next_tick) {
+		return;
+	}
+	// jitter is smoothed like RFC 3550 interarrival jitter
+	diff = (int64_t)(now - daemon->next_tick) - (int64_t)daemon->tick_lateness;
+	diff = diff < 0 ? -diff : diff;
+	daemon->tick_jitter += (diff - (int64_t)daemon->tick_jitter) / 16;
+	daemon->tick_lateness = now - daemon->next_tick;
+
+	for (n=0;n<daemon->max_catchup && daemon->next_tick <= now;n++) {
+		daemon_tick(daemon, tick);
+		daemon->next_tick += daemon->tick_period;
+	}
+	// too far behind, skip ahead on the same schedule instead of bursting
+	if (daemon->next_tick <= now) {
+		missed = (now - daemon->next_tick) / daemon->tick_period + 1;
+		daemon->next_tick += missed * daemon->tick_period;
+		daemon->ticks_missed += missed;
+		fprintf(stderr, "Could not reach tick rate, skipped %llu ticks (%llu us late)\n",
+				(unsigned long long)missed, (unsigned long long)daemon->tick_lateness/1000);
+	}
+}
+
+bool daemon_select(daemon_t *daemon, int *tick)
+{
+	int i,ready,maxfd,fd;
+	struct timeval timeout;
+
+	FD_ZERO(&daemon->fds);
+	FD_ZERO(&daemon->wfds);
+	FD_SET(daemon->server_fd, &daemon->fds);
+	maxfd = daemon->server_fd;
+	if (daemon->watch_fd >= 0) {
+		FD_SET(daemon->watch_fd, &daemon->fds);
+		maxfd = daemon->watch_fd>maxfd?daemon->watch_fd:maxfd;
+	}
+	for (i=0;i<daemon->slots;i++) {
+		if (daemon->client_fd[i] >= 0) {
+			FD_SET(daemon->client_fd[i], &daemon->fds);
+			if (daemon->client_queue[i].frames.count || daemon->client_queue[i].resync) {
+				FD_SET(daemon->client_fd[i], &daemon->wfds);
+			}
+			maxfd = daemon->client_fd[i]>maxfd?daemon->client_fd[i]:maxfd;
+		}
+	}
+
+	daemon_set_timeout(daemon, &timeout);
+	ready = select(maxfd+1, &daemon->fds, &daemon->wfds, NULL, &timeout);
+	if (ready < 0) {
+		if (errno == EINTR) {
+			return true;
+		}
+		fprintf(stderr, "Could not select from sockets\n");
+		return false;
+	}
+	daemon->wakeups++;
+	// if server has data
+	if (FD_ISSET(daemon->server_fd, &daemon->fds)) {
+		daemon_accept(daemon, daemon->server_fd);
+	}
+	if (daemon->watch_fd >= 0 && FD_ISSET(daemon->watch_fd, &daemon->fds)) {
+		daemon_accept(daemon, daemon->watch_fd);
+	}
+	/* check all connections */
+	for (i=0;i<daemon->slots;i++) {
+		fd = daemon->client_fd[i];
+		// if client can take more output
+		if ((fd >= 0) && FD_ISSET(fd, &daemon->wfds)) {
+			daemon_flush(daemon,i);
+		}
+		// if client has data
+		if ((fd >= 0) && (daemon->client_fd[i] == fd) && FD_ISSET(fd, &daemon->fds) && daemon_receive(daemon,i)) {
+			daemon->on_data(daemon,i);
+		}
+	}
+	daemon_tick_due(daemon, tick);
+	return true;
+}
+
+bool daemon_epoll(daemon_t *daemon, int *tick)
+{
+	int i,ready,fd,msec;
+	uint32_t slot, events;
+	uint64_t expirations;
+	struct timeval timeout;
+
+	// the timer wakes us with nanosecond precision, otherwise round up to ms
+	msec = -1;
+	if (daemon->timer_fd < 0) {
+		daemon_set_timeout(daemon, &timeout);
+		msec = timeout.tv_sec*1000 + (timeout.tv_usec+999)/1000;
+	}
+	ready = epoll_wait(daemon->epoll_fd, daemon->events, daemon->nevents, msec);
+	if (ready < 0) {
+		if (errno == EINTR) {
+			return true;
+		}
+		fprintf(stderr, "Could not wait for sockets\n");
+		return false;
+	}
+	daemon->wakeups++;
+	// only ready descriptors are visited
+	for (i=0;i<ready;i++) {
+		fd = daemon->events[i].data.u64 >> 32;
+		slot = daemon->events[i].data.u64 & 0xffffffff;
+		if (slot == UINT32_MAX) {
+			daemon_accept(daemon, daemon->server_fd);
+			continue;
+		}
+		if (slot == UINT32_MAX-2) {
+			daemon_accept(daemon, daemon->watch_fd);
+			continue;
+		}
+		if (slot == UINT32_MAX-1) {
+			read(daemon->timer_fd, &expirations, sizeof(expirations));
+			continue;
+		}
+		events = daemon->events[i].events;
+		// the error queue also reports finished zero copy sends
+		if ((events & EPOLLERR) && daemon->client_fd[slot] == fd && daemon->client_queue[slot].zerocopy_frames.count) {
+			daemon_reap_zerocopy(daemon,slot);
+			events &= ~EPOLLERR;
+		}
+		if ((events & EPOLLOUT) && daemon->client_fd[slot] == fd) {
+			daemon_flush(daemon,slot);
+		}
+		if ((events & ~EPOLLOUT) && daemon->client_fd[slot] == fd && daemon_receive(daemon,slot)) {
+			daemon->on_data(daemon,slot);
+		}
+	}
+	daemon_tick_due(daemon, tick);
+	return true;
+}
+
+void daemon_uring_add_buffer(daemon_uring_t *uring, uint16_t bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &uring->buf_ring->bufs[uring->buf_tail & (DAEMON_URING_BUFFERS-1)];
+	buf->addr = (uint64_t)(uintptr_t)(uring->buffers + bid * DAEMON_URING_BUFSIZE);
+	buf->len = DAEMON_URING_BUFSIZE;
+	buf->bid = bid;
+	uring->buf_tail++;
+	__atomic_store_n(&uring->buf_ring->tail, uring->buf_tail, __ATOMIC_RELEASE);
+}
+
+void daemon_uring_on_accept(daemon_t *daemon, struct io_uring_cqe *cqe)
+{
+	int fd;
+	bool spectator;
+	socklen_t len;
+	struct sockaddr_in address;
+
+	spectator = (cqe->user_data & 0xffffffff) != 0;
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		daemon->uring->naccepts--;
+		if (!daemon->uring->stopping) {
+			daemon_uring_accept(daemon, spectator);
+		}
+	}
+	fd = cqe->res;
+	if (fd < 0) {
+		if (fd == -ECANCELED && daemon->uring->stopping) {
+			return;
+		}
+		if (fd == -ECONNABORTED) {
+			daemon->dropped++;
+			return;
+		}
+		fprintf(stderr, "accept failed\n");
+		return;
+	}
+
+	// multishot accept cannot fill in the address
+	memset(&address, 0 ,sizeof(address));
+	len = sizeof(address);
+	getpeername(fd, (struct sockaddr *)&address, &len);
+	daemon_add_client(daemon, fd, &address, spectator);
+}
+
+void daemon_uring_on_recv(daemon_t *daemon, int client, struct io_uring_cqe *cqe)
+{
+	int nbytes;
+	uint16_t bid;
+	daemon_uring_t *uring = daemon->uring;
+
+	if (cqe->res > 0) {
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		nbytes = 0;
+		if (daemon->client_fd[client] >= 0) {
+			nbytes = daemon_input_push(&daemon->client_input[client], uring->buffers + bid * DAEMON_URING_BUFSIZE, cqe->res);
+		}
+		daemon_uring_add_buffer(uring, bid);
+		if (nbytes) {
+			daemon->on_data(daemon,client);
+		}
+	}
+	if (cqe->flags & IORING_CQE_F_MORE) {
+		return;
+	}
+	// the multishot receive ended, because of eof, an error or no buffers
+	if (daemon->client_fd[client] >= 0) {
+		// cancelled for a handoff, what else came in stays in the socket
+		if (uring->stopping && (cqe->res > 0 || cqe->res == -ENOBUFS || cqe->res == -ECANCELED)) {
+			daemon_uring_done(daemon, client);
+			return;
+		}
+		// the new receive holds the slot in place of this one
+		if ((cqe->res > 0 || cqe->res == -ENOBUFS) && daemon_uring_recv(daemon, client)) {
+			daemon_uring_done(daemon, client);
+			return;
+		}
+		daemon_disconnect(daemon,client);
+	}
+	daemon_uring_done(daemon, client);
+}
+
+void daemon_uring_on_send(daemon_t *daemon, int client, struct io_uring_cqe *cqe)
+{
+	int i;
+	daemon_queue_t *queue = &daemon->client_queue[client];
+	daemon_uring_client_t *state = &daemon->uring->clients[client];
+
+	for (i=0;i<state->nsending;i++) {
+		daemon_frame_release(state->sending[i]);
+	}
+	state->nsending = 0;
+	if (daemon->client_fd[client] < 0) {
+		daemon_uring_done(daemon, client);
+		return;
+	}
+	if (cqe->res <= 0) {
+		// a send cancelled for a handoff did not start, its frames stay queued
+		if (cqe->res != -ECANCELED || !daemon->uring->stopping) {
+			daemon_disconnect(daemon,client);
+		}
+		daemon_uring_done(daemon, client);
+		return;
+	}
+	daemon_queue_advance(queue, cqe->res);
+	daemon_uring_done(daemon, client);
+	if (queue->frames.count || queue->resync) {
+		daemon_want_write(daemon, client, true);
+	}
+}
+
+// clients whose backlog was dropped and has drained since
+void daemon_uring_flush(daemon_t *daemon)
+{
+	int client;
+	daemon_queue_t *queue;
+	daemon_uring_t *uring = daemon->uring;
+
+	while (uring->npending) {
+		client = uring->pending[--uring->npending];
+		uring->clients[client].pending = false;
+		queue = &daemon->client_queue[client];
+		if (daemon->client_fd[client] < 0 || uring->clients[client].nsending || queue->frames.count) {
+			continue;
+		}
+		// the backlog is gone, let the game repaint what was dropped
+		if (queue->resync) {
+			queue->resync = false;
+			daemon->on_resync(daemon, client);
+		}
+	}
+}
+
+void daemon_uring_reap(daemon_t *daemon)
+{
+	unsigned head;
+	uint32_t slot;
+	struct io_uring_cqe *cqe;
+	daemon_uring_t *uring = daemon->uring;
+
+	head = *uring->cq_head;
+	while (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &uring->cqes[head & *uring->cq_mask];
+		slot = cqe->user_data & 0xffffffff;
+		switch (cqe->user_data >> 32) {
+			case uring_accept:  daemon_uring_on_accept(daemon, cqe); break;
+			case uring_recv:    daemon_uring_on_recv(daemon, slot, cqe); break;
+			case uring_send:    daemon_uring_on_send(daemon, slot, cqe); break;
+			case uring_timeout: uring->timeout_armed = false; break;
+			case uring_cancel:  uring->cancelling = false; break;
+		}
+		head++;
+		__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+
+bool daemon_uring(daemon_t *daemon, int *tick)
+{
+	int i;
+	struct io_uring_sqe *sqe;
+	daemon_uring_t *uring = daemon->uring;
+
+	daemon_uring_flush(daemon);
+	for (i=0;i<2;i++) {
+		if (uring->lost_accept[i] && !uring->stopping) {
+			uring->lost_accept[i] = false;
+			daemon_uring_accept(daemon, i);
+		}
+	}
+	sqe = NULL;
+	if (!uring->timeout_armed) {
+		uring->timeout.tv_sec = daemon->next_tick / 1000000000ULL;
+		uring->timeout.tv_nsec = daemon->next_tick % 1000000000ULL;
+		sqe = daemon_uring_sqe(uring, uring_timeout, 0);
+	}
+	if (sqe) {
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->fd = -1;
+		sqe->addr = (uint64_t)(uintptr_t)&uring->timeout;
+		sqe->len = 1;
+		sqe->timeout_flags = IORING_TIMEOUT_ABS;
+		uring->timeout_armed = true;
+	}
+	// all sends of this tick and the wait for the next events in one syscall,
+	// without a timeout armed it only looks, and a busy ring is reaped first
+	if (!daemon_uring_submit(uring, uring->timeout_armed)) {
+		if (errno != EINTR && errno != EBUSY) {
+			fprintf(stderr, "Could not wait for io_uring\n");
+			return false;
+		}
+	} else {
+		daemon->wakeups++;
+	}
+	daemon_uring_reap(daemon);
+	daemon_tick_due(daemon, tick);
+	return true;
+}
+
+// cancels every request, receives and accepts end and a send either went
+// out or never started, so the kernel touches no socket after this, false
+// when the requests could not all be cancelled
+bool daemon_uring_stop(daemon_t *daemon)
+{
+	int i;
+	bool busy;
+	struct io_uring_sqe *sqe;
+	daemon_uring_t *uring = daemon->uring;
+
+	// a busy ring makes room once its completions are reaped
+	sqe = daemon_uring_sqe(uring, uring_cancel, 0);
+	if (!sqe) {
+		daemon_uring_reap(daemon);
+		sqe = daemon_uring_sqe(uring, uring_cancel, 0);
+	}
+	if (!sqe) {
+		fprintf(stderr, "Could not cancel io_uring requests\n");
+		return false;
+	}
+	uring->stopping = true;
+	uring->cancelling = true;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_ANY;
+	do {
+		if (!daemon_uring_submit(uring, 1) && errno != EINTR && errno != EBUSY) {
+			fprintf(stderr, "Could not wait for io_uring\n");
+			return false;
+		}
+		daemon_uring_reap(daemon);
+		busy = uring->cancelling || uring->naccepts || uring->timeout_armed;
+		for (i=0;i<daemon->slots && !busy;i++) {
+			busy = uring->clients[i].inflight > 0;
+		}
+	} while (busy);
+	return true;
+}
+
+// the handoff failed, so receive and accept again
+void daemon_uring_resume(daemon_t *daemon)
+{
+	int i;
+
+	daemon->uring->stopping = false;
+	for (i=0;i<daemon->slots;i++) {
+		if (daemon->client_fd[i] >= 0) {
+			daemon_resume_client(daemon, i);
+		}
+	}
+	daemon_uring_accept(daemon, false);
+	if (daemon->watch_fd >= 0) {
+		daemon_uring_accept(daemon, true);
+	}
+}
+
+void daemon_uring_destroy(daemon_uring_t *uring)
+{
+	if (uring->fd >= 0) {
+		close(uring->fd);
+	}
+	if (uring->ring) {
+		munmap(uring->ring, uring->ring_size);
+	}
+	if (uring->sqes) {
+		munmap(uring->sqes, uring->sqes_size);
+	}
+	if (uring->buf_ring) {
+		munmap(uring->buf_ring, uring->buf_ring_size);
+	}
+	free(uring->buffers);
+	free(uring->pending);
+	free(uring->clients);
+	free(uring);
+}
+
+static const int daemon_uring_ops[] = {
+	IORING_OP_RECV, IORING_OP_ACCEPT, IORING_OP_SENDMSG, IORING_OP_TIMEOUT, IORING_OP_ASYNC_CANCEL, IORING_OP_SEND_ZC
+};
+
+// needs multishot accept and receive with a buffer ring, so linux 6.0, the
+// buffer ring is checked when it is registered
+bool daemon_uring_init(daemon_t *daemon)
+{
+	int i;
+	bool supported;
+	daemon_uring_t *uring;
+	struct io_uring_params params;
+	struct io_uring_probe *probe;
+	struct io_uring_buf_reg reg;
+
+	uring = malloc(sizeof(*uring));
+	memset(uring,0,sizeof(*uring));
+	memset(&params,0,sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+	params.cq_entries = DAEMON_URING_ENTRIES * 4;
+	uring->fd = syscall(__NR_io_uring_setup, DAEMON_URING_ENTRIES, &params);
+	if (uring->fd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		daemon_uring_destroy(uring);
+		return false;
+	}
+
+	// the ops that are issued, and multishot receive has no flag of its own,
+	// so send_zc, which is never issued, stands in for linux 6.0 that has it
+	probe = malloc(sizeof(*probe) + 256 * sizeof(probe->ops[0]));
+	memset(probe,0,sizeof(*probe) + 256 * sizeof(probe->ops[0]));
+	supported = syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+			probe->last_op >= IORING_OP_SEND_ZC;
+	for (i=0;i<(int)(sizeof(daemon_uring_ops)/sizeof(*daemon_uring_ops)) && supported;i++) {
+		supported = probe->ops[daemon_uring_ops[i]].flags & IO_URING_OP_SUPPORTED;
+	}
+	free(probe);
+	if (!supported) {
+		daemon_uring_destroy(uring);
+		return false;
+	}
+
+	uring->ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	if (uring->ring_size < params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe)) {
+		uring->ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	}
+	uring->ring = mmap(NULL, uring->ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+	uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+	uring->buf_ring_size = DAEMON_URING_BUFFERS * sizeof(struct io_uring_buf);
+	uring->buf_ring = mmap(NULL, uring->buf_ring_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (uring->ring == MAP_FAILED || uring->sqes == MAP_FAILED || uring->buf_ring == MAP_FAILED) {
+		uring->ring = uring->ring == MAP_FAILED ? NULL : uring->ring;
+		uring->sqes = uring->sqes == MAP_FAILED ? NULL : uring->sqes;
+		uring->buf_ring = uring->buf_ring == MAP_FAILED ? NULL : uring->buf_ring;
+		daemon_uring_destroy(uring);
+		return false;
+	}
+	uring->sq_head = (unsigned *)((char *)uring->ring + params.sq_off.head);
+	uring->sq_tail = (unsigned *)((char *)uring->ring + params.sq_off.tail);
+	uring->sq_mask = (unsigned *)((char *)uring->ring + params.sq_off.ring_mask);
+	uring->sq_array = (unsigned *)((char *)uring->ring + params.sq_off.array);
+	uring->cq_head = (unsigned *)((char *)uring->ring + params.cq_off.head);
+	uring->cq_tail = (unsigned *)((char *)uring->ring + params.cq_off.tail);
+	uring->cq_mask = (unsigned *)((char *)uring->ring + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *)((char *)uring->ring + params.cq_off.cqes);
+
+	memset(&reg,0,sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)uring->buf_ring;
+	reg.ring_entries = DAEMON_URING_BUFFERS;
+	reg.bgid = 0;
+	if (syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		daemon_uring_destroy(uring);
+		return false;
+	}
+	uring->buffers = malloc(DAEMON_URING_BUFFERS * DAEMON_URING_BUFSIZE);
+	for (i=0;i<DAEMON_URING_BUFFERS;i++) {
+		daemon_uring_add_buffer(uring, i);
+	}
+
+	uring->pending = malloc(daemon->slots * sizeof(*uring->pending));
+	uring->clients = malloc(daemon->slots * sizeof(*uring->clients));
+	memset(uring->clients,0,daemon->slots * sizeof(*uring->clients));
+	daemon->uring = uring;
+	daemon_uring_accept(daemon, false);
+	if (daemon->watch_fd >= 0) {
+		daemon_uring_accept(daemon, true);
+	}
+	return true;
+}
+
+// periodic timer on the tick schedule, so epoll is not limited to ms timeouts
+void daemon_init_timer(daemon_t *daemon)
+{
+	struct itimerspec spec;
+	struct epoll_event event;
+
+	daemon->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (daemon->timer_fd < 0) {
+		return;
+	}
+	spec.it_value.tv_sec = daemon->next_tick / 1000000000ULL;
+	spec.it_value.tv_nsec = daemon->next_tick % 1000000000ULL;
+	spec.it_interval.tv_sec = daemon->tick_period / 1000000000ULL;
+	spec.it_interval.tv_nsec = daemon->tick_period % 1000000000ULL;
+	event.events = EPOLLIN;
+	event.data.u64 = daemon_event_data(daemon->timer_fd, UINT32_MAX-1);
+	if (timerfd_settime(daemon->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0 ||
+			epoll_ctl(daemon->epoll_fd, EPOLL_CTL_ADD, daemon->timer_fd, &event) < 0) {
+		close(daemon->timer_fd);
+		daemon->timer_fd = -1;
+	}
+}
+
+bool daemon_init_backend(daemon_t *daemon)
+{
+	struct epoll_event event;
+
+	if (daemon->backend == backend_uring) {
+		if (daemon_uring_init(daemon)) {
+			return true;
+		}
+		fprintf(stderr, "io_uring not available, falling back to epoll\n");
+	}
+	// accepting until EAGAIN needs a listener that does not block
+	fcntl(daemon->server_fd, F_SETFL, fcntl(daemon->server_fd, F_GETFL) | O_NONBLOCK);
+	if (daemon->watch_fd >= 0) {
+		fcntl(daemon->watch_fd, F_SETFL, fcntl(daemon->watch_fd, F_GETFL) | O_NONBLOCK);
+	}
+	if (daemon->backend == backend_select) {
+		return true;
+	}
+	daemon->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (daemon->epoll_fd < 0) {
+		if (daemon->backend == backend_epoll) {
+			fprintf(stderr, "Could not create epoll instance\n");
+			return false;
+		}
+		fprintf(stderr, "epoll not available, falling back to select\n");
+		return true;
+	}
+	daemon->nevents = daemon->slots + 1 < 1024 ? daemon->slots + 1 : 1024;
+	daemon->events = malloc(daemon->nevents * sizeof(*daemon->events));
+	event.events = EPOLLIN;
+	event.data.u64 = daemon_event_data(daemon->server_fd, UINT32_MAX);
+	if (epoll_ctl(daemon->epoll_fd, EPOLL_CTL_ADD, daemon->server_fd, &event) < 0) {
+		fprintf(stderr, "Could not add server to epoll\n");
+		return false;
+	}
+	event.data.u64 = daemon_event_data(daemon->watch_fd, UINT32_MAX-2);
+	if (daemon->watch_fd >= 0 && epoll_ctl(daemon->epoll_fd, EPOLL_CTL_ADD, daemon->watch_fd, &event) < 0) {
+		fprintf(stderr, "Could not add watch port to epoll\n");
+		return false;
+	}
+	daemon_init_timer(daemon);
+	return true;
+}
+
+void daemon_pin(daemon_t *daemon)
+{
+	cpu_set_t cpus;
+	long ncpus;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 1) {
+		return;
+	}
+	CPU_ZERO(&cpus);
+	CPU_SET(daemon->shard % ncpus, &cpus);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+		fprintf(stderr, "Could not pin shard %d to a cpu\n", daemon->shard);
+	}
+}
+
+// the file of a state closes its memfd, the descriptors are not closed,
+// they are the ones of the clients
+void daemon_state_clear(daemon_state_t *state)
+{
+	if (state->file) {
+		fclose(state->file);
+	}
+	free(state->fds);
+	memset(state,0,sizeof(*state));
+}
+
+// what the client did not read or was not sent yet, a partly sent frame
+// goes out from where it was, zero copy frames are done with already
+void daemon_save_client(daemon_t *daemon, daemon_state_t *state, int client)
+{
+	int i, nbytes;
+	char bytes[DAEMON_INPUT];
+	daemon_frame_t *frame;
+	daemon_input_t *input = &daemon->client_input[client];
+	daemon_queue_t *queue = &daemon->client_queue[client];
+
+	daemon_save(state, &client, sizeof(client));
+	daemon_save_fd(state, daemon->client_fd[client]);
+	daemon_save(state, &daemon->client_address[client], sizeof(daemon->client_address[client]));
+	daemon_save(state, &daemon->client_spectator[client], sizeof(daemon->client_spectator[client]));
+	daemon_save(state, &daemon->client_binary[client], sizeof(daemon->client_binary[client]));
+	for (i=0;i<input->count;i++) {
+		bytes[i] = input->bytes[(input->first + i) & (DAEMON_INPUT - 1)];
+	}
+	daemon_save(state, &input->count, sizeof(input->count));
+	daemon_save(state, bytes, input->count);
+	daemon_save(state, &queue->resync, sizeof(queue->resync));
+	daemon_save(state, &queue->resync_tick, sizeof(queue->resync_tick));
+	daemon_save(state, &queue->last_frame, sizeof(queue->last_frame));
+	daemon_save(state, &queue->bytes_sent, sizeof(queue->bytes_sent));
+	daemon_save(state, &queue->frames_sent, sizeof(queue->frames_sent));
+	daemon_save(state, &queue->zerocopy, sizeof(queue->zerocopy));
+	// the kernel numbers the zero copy sends of the socket on from here
+	daemon_save(state, &queue->zerocopy_seq, sizeof(queue->zerocopy_seq));
+	daemon_save(state, &queue->zerocopy_frames.count, sizeof(queue->zerocopy_frames.count));
+	daemon_save(state, &queue->frames.count, sizeof(queue->frames.count));
+	for (i=0;i<queue->frames.count;i++) {
+		frame = daemon_ring_get(&queue->frames, i);
+		nbytes = frame->nbytes - (i ? 0 : queue->offset);
+		daemon_save(state, &frame->id, sizeof(frame->id));
+		daemon_save(state, &nbytes, sizeof(nbytes));
+		daemon_save(state, frame->bytes + frame->nbytes - nbytes, nbytes);
+	}
+}
+
+bool daemon_load_client(daemon_t *daemon, daemon_state_t *state, int client)
+{
+	int i, n, nbytes;
+	uint64_t id;
+	daemon_frame_t *frame;
+	daemon_input_t *input = &daemon->client_input[client];
+	daemon_queue_t *queue = &daemon->client_queue[client];
+
+	daemon->client_fd[client] = daemon_load_fd(state);
+	// an older process may have accepted it blocking
+	if (daemon->client_fd[client] >= 0) {
+		fcntl(daemon->client_fd[client], F_SETFL, fcntl(daemon->client_fd[client], F_GETFL) | O_NONBLOCK);
+	}
+	daemon_load(state, &daemon->client_address[client], sizeof(daemon->client_address[client]));
+	daemon_load(state, &daemon->client_spectator[client], sizeof(daemon->client_spectator[client]));
+	daemon_load(state, &daemon->client_binary[client], sizeof(daemon->client_binary[client]));
+	if (!daemon_load(state, &input->count, sizeof(input->count)) || input->count < 0 || input->count > DAEMON_INPUT) {
+		return false;
+	}
+	daemon_load(state, input->bytes, input->count);
+	daemon_load(state, &queue->resync, sizeof(queue->resync));
+	daemon_load(state, &queue->resync_tick, sizeof(queue->resync_tick));
+	daemon_load(state, &queue->last_frame, sizeof(queue->last_frame));
+	daemon_load(state, &queue->bytes_sent, sizeof(queue->bytes_sent));
+	daemon_load(state, &queue->frames_sent, sizeof(queue->frames_sent));
+	daemon_load(state, &queue->zerocopy, sizeof(queue->zerocopy));
+	daemon_load(state, &queue->zerocopy_seq, sizeof(queue->zerocopy_seq));
+	daemon_load(state, &n, sizeof(n));
+	queue->zerocopy_seq += n;
+	if (!daemon_load(state, &n, sizeof(n))) {
+		return false;
+	}
+	for (i=0;i<n;i++) {
+		if (!daemon_load(state, &id, sizeof(id)) || !daemon_load(state, &nbytes, sizeof(nbytes)) || nbytes < 0) {
+			return false;
+		}
+		frame = malloc(sizeof(*frame) + nbytes);
+		frame->refs = 1;
+		frame->id = id;
+		frame->nbytes = nbytes;
+		daemon_ring_push(&queue->frames, frame);
+		queue->nbytes += nbytes;
+		if (!daemon_load(state, frame->bytes, nbytes)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// the schedule, the counters, the listeners and the clients, and then what
+// the game saves, into a memfd that is sent to the new process
+void daemon_save_shard(daemon_t *daemon, daemon_state_t *state, int tick)
+{
+	int i, fd, nclients;
+	bool watching;
+
+	memset(state,0,sizeof(*state));
+	fd = memfd_create("daemon-state", MFD_CLOEXEC);
+	state->file = fd < 0 ? NULL : fdopen(fd, "w+");
+	if (!state->file) {
+		fprintf(stderr, "Could not create state of shard %d\n", daemon->shard);
+		if (fd >= 0) {
+			close(fd);
+		}
+		state->failed = true;
+		return;
+	}
+	daemon_save(state, &tick, sizeof(tick));
+	daemon_save(state, &daemon->next_tick, sizeof(daemon->next_tick));
+	for (i=0;i<(int)(sizeof(daemon_saved_counters)/sizeof(*daemon_saved_counters));i++) {
+		daemon_save(state, (char *)daemon + daemon_saved_counters[i], sizeof(uint64_t));
+	}
+	daemon_save(state, daemon->tick_buckets, sizeof(daemon->tick_buckets));
+	daemon_save(state, &daemon->server_address, sizeof(daemon->server_address));
+	daemon_save_fd(state, daemon->server_fd);
+	watching = daemon->watch_fd >= 0;
+	daemon_save(state, &watching, sizeof(watching));
+	if (watching) {
+		daemon_save_fd(state, daemon->watch_fd);
+	}
+	nclients = 0;
+	for (i=0;i<daemon->slots;i++) {
+		nclients += daemon->client_fd[i] >= 0;
+	}
+	daemon_save(state, &nclients, sizeof(nclients));
+	for (i=0;i<daemon->slots;i++) {
+		if (daemon->client_fd[i] >= 0) {
+			daemon_save_client(daemon, state, i);
+		}
+	}
+	daemon->on_save(daemon, state);
+	if (fflush(state->file) != 0) {
+		state->failed = true;
+	}
+}
+
+// clients keep their slots, so the game finds them where they were
+bool daemon_load_shard(daemon_t *daemon, daemon_state_t *state, int *tick)
+{
+	int i, client, nclients;
+	bool watching;
+	uint64_t now;
+
+	daemon_load(state, tick, sizeof(*tick));
+	daemon_load(state, &daemon->next_tick, sizeof(daemon->next_tick));
+	for (i=0;i<(int)(sizeof(daemon_saved_counters)/sizeof(*daemon_saved_counters));i++) {
+		daemon_load(state, (char *)daemon + daemon_saved_counters[i], sizeof(uint64_t));
+	}
+	daemon_load(state, daemon->tick_buckets, sizeof(daemon->tick_buckets));
+	daemon_load(state, &daemon->server_address, sizeof(daemon->server_address));
+	daemon->server_fd = daemon_load_fd(state);
+	if (daemon_load(state, &watching, sizeof(watching)) && watching) {
+		daemon->watch_fd = daemon_load_fd(state);
+	}
+	if (!daemon_load(state, &nclients, sizeof(nclients))) {
+		return false;
+	}
+	for (i=0;i<nclients;i++) {
+		if (!daemon_load(state, &client, sizeof(client)) || client < 0 || client >= daemon->slots || daemon->client_fd[client] >= 0) {
+			return false;
+		}
+		if (!daemon_load_client(daemon, state, client)) {
+			return false;
+		}
+	}
+	daemon->nfree = 0;
+	for (i=daemon->slots-1;i>=0;i--) {
+		if (daemon->client_fd[i] < 0) {
+			daemon->free_slots[daemon->nfree++] = i;
+		}
+	}
+	// the tick rate may have changed, and a late tick is not made up for
+	*tick = *tick >= 0 ? *tick % daemon->ticks : 0;
+	now = daemon_clock();
+	if (daemon->next_tick < now) {
+		daemon->next_tick = now;
+	}
+	return !state->failed && daemon->on_load(daemon, state);
+}
+
+// the shard stopped after a tick, it saves and waits for the outcome, true
+// when the new process took over and the loop can end
+bool daemon_hand_over(daemon_t *daemon, int tick)
+{
+	bool done, stopped;
+	daemon_handoff_t *handoff = daemon->handoff;
+	daemon_state_t *state = &handoff->states[daemon->shard];
+
+	stopped = !daemon->uring || daemon_uring_stop(daemon);
+	daemon_save_shard(daemon, state, tick);
+	// sockets the kernel may still use are not handed over
+	if (!stopped) {
+		state->failed = true;
+	}
+	pthread_mutex_lock(&handoff->lock);
+	handoff->nready++;
+	pthread_cond_broadcast(&handoff->cond);
+	while (handoff->state == handoff_saving) {
+		pthread_cond_wait(&handoff->cond, &handoff->lock);
+	}
+	done = handoff->state == handoff_done;
+	pthread_mutex_unlock(&handoff->lock);
+	daemon_state_clear(state);
+	if (!done && daemon->uring && daemon->uring->stopping) {
+		daemon_uring_resume(daemon);
+	}
+	return done;
+}
+
+// the new process only starts once every shard loaded its state, and the
+// old one goes on when any of them could not
+bool daemon_handoff_ready(daemon_handoff_t *handoff, bool loaded)
 {
-	int result;
-	result = read(daemon->client_fd[client], bytes, nbytes);
-	if (result <= 0) {
-		daemon_disconnect(daemon,client);
-		return -1;
+	char ack;
+
+	pthread_mutex_lock(&handoff->lock);
+	handoff->failed = handoff->failed || !loaded;
+	if (++handoff->nready == handoff->nshards) {
+		ack = !handoff->failed;
+		send(handoff->fd, &ack, sizeof(ack), MSG_NOSIGNAL);
+		close(handoff->fd);
+		handoff->fd = -1;
+		pthread_cond_broadcast(&handoff->cond);
 	}
-	return result;
+	while (handoff->nready < handoff->nshards) {
+		pthread_cond_wait(&handoff->cond, &handoff->lock);
+	}
+	loaded = !handoff->failed;
+	pthread_mutex_unlock(&handoff->lock);
+	return loaded;
 }
 
-int daemon_write(daemon_t *daemon, int client, char *bytes, int nbytes)
+// takes the shard over from the old process, no socket is touched before
+// all shards loaded their state
+bool daemon_adopt(daemon_t *daemon, int *tick)
 {
-	int result;
+	int i;
+	bool loaded;
+	daemon_state_t *state = &daemon->handoff->states[daemon->shard];
 
-	result = write(daemon->client_fd[client], bytes, nbytes);
-	if (result < nbytes) {
-		daemon_disconnect(daemon,client);
-		return -1;
+	loaded = daemon_load_shard(daemon, state, tick);
+	daemon_state_clear(state);
+	if (!loaded) {
+		fprintf(stderr, "Could not load state of shard %d\n", daemon->shard);
 	}
-	return result;
+	if (!daemon_handoff_ready(daemon->handoff, loaded) || !daemon_init_backend(daemon)) {
+		return false;
+	}
+	for (i=0;i<daemon->slots;i++) {
+		if (daemon->client_fd[i] >= 0) {
+			daemon_resume_client(daemon, i);
+		}
+	}
+	return true;
 }
 
-bool daemon_listen(daemon_t *daemon)
+bool daemon_loop(daemon_t *daemon)
 {
-	int value;
+	int i,tick;
+	bool success;
 
-	daemon->server_fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (daemon->server_fd < 0) {
-		fprintf(stderr, "Could not create socket\n");
-		return false;
+	if (daemon->pin_cpus) {
+		daemon_pin(daemon);
 	}
+	daemon->on_start(daemon);
 
-	value = 1;
-	if (setsockopt(daemon->server_fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value)) < 0) {
-		fprintf(stderr, "Could not set socket reuse option\n");
-		return false;
+	daemon->tick_period = 1000000000ULL / daemon->ticks;
+	daemon->next_tick = daemon_clock() + daemon->tick_period;
+	tick = 0;
+	if (daemon->handoff && daemon->handoff->adopting) {
+		success = daemon_adopt(daemon, &tick);
+	} else {
+		success = daemon_listen(daemon) && daemon_init_backend(daemon);
 	}
 
-	memset(&daemon->server_address, 0 ,sizeof(daemon->server_address));
-	daemon->server_address.sin_family = AF_INET;
-	daemon->server_address.sin_port = htons(daemon->port);
-	daemon->server_address.sin_addr.s_addr = htonl(daemon->ip);
+	while (success) {
+		if (daemon->uring) {
+			success = daemon_uring(daemon, &tick);
+		} else if (daemon->epoll_fd >= 0) {
+			success = daemon_epoll(daemon, &tick);
+		} else {
+			success = daemon_select(daemon, &tick);
+		}
+		// an upgrade stops the loop between ticks, for good once the new
+		// process took over, the sockets are only closed here
+		if (success && daemon->handoff && __atomic_load_n(&daemon->handoff->state, __ATOMIC_ACQUIRE) == handoff_saving
+				&& daemon_hand_over(daemon, tick)) {
+			break;
+		}
+	}
 
-	if (bind(daemon->server_fd, (const struct sockaddr *)&daemon->server_address, sizeof(daemon->server_address)) < 0) {
-		fprintf(stderr, "Could not bind socket\n");
-		return false;
+	// closing the ring cancels whatever is still in flight
+	if (daemon->uring) {
+		daemon_uring_destroy(daemon->uring);
+	}
+	for (i=0;i<daemon->slots;i++) {
+		if (daemon->client_fd[i] >= 0) {
+			close(daemon->client_fd[i]);
+			daemon_queue_clear(&daemon->client_queue[i]);
+		}
+	}
+	if (daemon->timer_fd >= 0) {
+		close(daemon->timer_fd);
+	}
+	if (daemon->epoll_fd >= 0) {
+		close(daemon->epoll_fd);
+	}
+	close(daemon->server_fd);
+	if (daemon->watch_fd >= 0) {
+		close(daemon->watch_fd);
 	}
 
-	if (listen(daemon->server_fd, 0) < 0){ // 1 or daemon->slots?
-		fprintf(stderr, "Could not listen on socket\n");
-		return false;
+	return success;
+}
+
+void *daemon_thread(void *daemon)
+{
+	return daemon_loop((daemon_t *)daemon) ? daemon : NULL;
+}
+
+// prometheus wants all samples of a metric together, so every family
+// lists the shards, field is the offset of a counter in daemon_t
+void daemon_metrics_family(FILE *out, daemon_metrics_t *metrics, const char *name, const char *type, const char *help, size_t field, bool seconds)
+{
+	int i;
+	uint64_t value;
+
+	fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+	for (i=0;i<metrics->nshards;i++) {
+		value = *(uint64_t *)((char *)metrics->shards[i] + field);
+		if (seconds) {
+			fprintf(out, "%s{shard=\"%d\"} %.9f\n", name, i, value / 1e9);
+		} else {
+			fprintf(out, "%s{shard=\"%d\"} %llu\n", name, i, (unsigned long long)value);
+		}
 	}
+}
 
-	return true;
+// one metric with a sample per connected client
+void daemon_metrics_clients(FILE *out, daemon_metrics_t *metrics, const char *name, const char *type, const char *help, size_t field)
+{
+	int i, client;
+	daemon_t *daemon;
+	daemon_queue_t *queue;
+
+	fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+	for (i=0;i<metrics->nshards;i++) {
+		daemon = metrics->shards[i];
+		for (client=0;client<daemon->slots;client++) {
+			if (daemon->client_fd[client] < 0) {
+				continue;
+			}
+			queue = &daemon->client_queue[client];
+			fprintf(out, "%s{shard=\"%d\",client=\"%d\"} %llu\n", name, i, client, (unsigned long long)*(uint64_t *)((char *)queue + field));
+		}
+	}
 }
 
-void daemon_set_timeout(daemon_t *daemon, struct timeval *timeout)
+void daemon_metrics_write(FILE *out, daemon_metrics_t *metrics)
 {
-	struct timeval now;
-	long diff, usec;
+	int i, j, client;
+	uint64_t count, bytes, frames;
+	daemon_t *daemon;
+	daemon_queue_t *queue;
+
+	fprintf(out, "# HELP daemon_tick_duration_seconds Time spent in on_tick.\n");
+	fprintf(out, "# TYPE daemon_tick_duration_seconds histogram\n");
+	for (i=0;i<metrics->nshards;i++) {
+		daemon = metrics->shards[i];
+		count = 0;
+		for (j=0;j<DAEMON_TICK_BUCKETS;j++) {
+			count += daemon->tick_buckets[j];
+			fprintf(out, "daemon_tick_duration_seconds_bucket{shard=\"%d\",le=\"%g\"} %llu\n", i, daemon_tick_bounds[j] / 1e9, (unsigned long long)count);
+		}
+		count = daemon->tick_count;
+		fprintf(out, "daemon_tick_duration_seconds_bucket{shard=\"%d\",le=\"+Inf\"} %llu\n", i, (unsigned long long)count);
+		fprintf(out, "daemon_tick_duration_seconds_sum{shard=\"%d\"} %.9f\n", i, daemon->tick_time / 1e9);
+		fprintf(out, "daemon_tick_duration_seconds_count{shard=\"%d\"} %llu\n", i, (unsigned long long)count);
+	}
+	daemon_metrics_family(out, metrics, "daemon_tick_lateness_seconds", "gauge", "How late the last tick fired.", offsetof(daemon_t, tick_lateness), true);
+	daemon_metrics_family(out, metrics, "daemon_tick_jitter_seconds", "gauge", "Smoothed variation of the tick lateness.", offsetof(daemon_t, tick_jitter), true);
+	daemon_metrics_family(out, metrics, "daemon_ticks_missed_total", "counter", "Ticks skipped to catch up.", offsetof(daemon_t, ticks_missed), false);
+	daemon_metrics_family(out, metrics, "daemon_wakeups_total", "counter", "Returns from waiting for events.", offsetof(daemon_t, wakeups), false);
+	daemon_metrics_family(out, metrics, "daemon_connects_total", "counter", "Clients accepted.", offsetof(daemon_t, accepted), false);
+	daemon_metrics_family(out, metrics, "daemon_disconnects_total", "counter", "Clients disconnected.", offsetof(daemon_t, disconnected), false);
+	daemon_metrics_family(out, metrics, "daemon_refused_total", "counter", "Connections turned away with a notice.", offsetof(daemon_t, refused), false);
+	daemon_metrics_family(out, metrics, "daemon_dropped_total", "counter", "Connections lost on errors.", offsetof(daemon_t, dropped), false);
 
-	timeout->tv_sec = 0;
-	gettimeofday(&now,NULL);
-	diff = (now.tv_sec-daemon->lasttick.tv_sec) * 1000000L;
-	diff = diff + (now.tv_usec - daemon->lasttick.tv_usec);
-	usec = 1000000L/daemon->ticks - diff;
-	if (usec<0) {
-		fprintf(stderr, "Could not reach tick rate\n");
-		usec = 0;
+	// totals add the clients that are still connected
+	fprintf(out, "# HELP daemon_sent_bytes_total Bytes written to clients.\n");
+	fprintf(out, "# TYPE daemon_sent_bytes_total counter\n");
+	for (i=0;i<metrics->nshards;i++) {
+		daemon = metrics->shards[i];
+		bytes = daemon->bytes_sent;
+		for (client=0;client<daemon->slots;client++) {
+			queue = &daemon->client_queue[client];
+			bytes += daemon->client_fd[client] >= 0 ? queue->bytes_sent : 0;
+		}
+		fprintf(out, "daemon_sent_bytes_total{shard=\"%d\"} %llu\n", i, (unsigned long long)bytes);
+	}
+	fprintf(out, "# HELP daemon_sent_frames_total Frames written to clients.\n");
+	fprintf(out, "# TYPE daemon_sent_frames_total counter\n");
+	for (i=0;i<metrics->nshards;i++) {
+		daemon = metrics->shards[i];
+		frames = daemon->frames_sent;
+		for (client=0;client<daemon->slots;client++) {
+			queue = &daemon->client_queue[client];
+			frames += daemon->client_fd[client] >= 0 ? queue->frames_sent : 0;
+		}
+		fprintf(out, "daemon_sent_frames_total{shard=\"%d\"} %llu\n", i, (unsigned long long)frames);
 	}
-	timeout->tv_usec = usec;
+	daemon_metrics_clients(out, metrics, "daemon_client_sent_bytes_total", "counter", "Bytes written to a client.", offsetof(daemon_queue_t, bytes_sent));
+	daemon_metrics_clients(out, metrics, "daemon_client_sent_frames_total", "counter", "Frames written to a client.", offsetof(daemon_queue_t, frames_sent));
 
+	fprintf(out, "# HELP daemon_client_queued_bytes Output waiting for a client.\n");
+	fprintf(out, "# TYPE daemon_client_queued_bytes gauge\n");
+	for (i=0;i<metrics->nshards;i++) {
+		daemon = metrics->shards[i];
+		for (client=0;client<daemon->slots;client++) {
+			if (daemon->client_fd[client] >= 0) {
+				fprintf(out, "daemon_client_queued_bytes{shard=\"%d\",client=\"%d\"} %d\n", i, client, daemon->client_queue[client].nbytes);
+			}
+		}
+	}
+	fprintf(out, "# HELP daemon_client_queued_frames Frames waiting for a client.\n");
+	fprintf(out, "# TYPE daemon_client_queued_frames gauge\n");
+	for (i=0;i<metrics->nshards;i++) {
+		daemon = metrics->shards[i];
+		for (client=0;client<daemon->slots;client++) {
+			if (daemon->client_fd[client] >= 0) {
+				fprintf(out, "daemon_client_queued_frames{shard=\"%d\",client=\"%d\"} %d\n", i, client, daemon->client_queue[client].frames.count);
+			}
+		}
+	}
 }
 
-void daemon_destroy(daemon_t *daemon)
+bool daemon_metrics_send(int fd, char *bytes, size_t nbytes)
 {
-	free(daemon->client_address);
-	free(daemon->client_fd);
-	free(daemon);
+	ssize_t result;
+
+	while (nbytes) {
+		result = send(fd, bytes, nbytes, MSG_NOSIGNAL);
+		if (result <= 0) {
+			return false;
+		}
+		bytes += result;
+		nbytes -= result;
+	}
+	return true;
 }
 
-bool daemon_run(daemon_t *daemon)
+// any request gets the snapshot, a stuck scraper is cut off after a second
+void daemon_metrics_serve(daemon_metrics_t *metrics, int fd)
 {
-	int i,ready,len,nclients,maxfd,tick;
-	bool success;
+	int nbytes, nrequest;
+	char request[2048], header[128];
+	char *body;
+	size_t nbody;
+	FILE *out;
 	struct timeval timeout;
 
-	for (i=0;i<daemon->slots;i++) {
-		daemon->client_fd[i] = -1;
+	timeout.tv_sec = 1;
+	timeout.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	nrequest = 0;
+	while (nrequest < (int)sizeof(request) - 1) {
+		nbytes = read(fd, request + nrequest, sizeof(request) - 1 - nrequest);
+		if (nbytes <= 0) {
+			return;
+		}
+		nrequest += nbytes;
+		request[nrequest] = 0;
+		if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+			break;
+		}
 	}
 
-	success = daemon_listen(daemon);
-	gettimeofday(&daemon->lasttick,NULL);
-	tick = 0;
+	out = open_memstream(&body, &nbody);
+	if (!out) {
+		return;
+	}
+	daemon_metrics_write(out, metrics);
+	fclose(out);
+	nbytes = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", nbody);
+	if (daemon_metrics_send(fd, header, nbytes)) {
+		daemon_metrics_send(fd, body, nbody);
+	}
+	free(body);
+}
 
-	while (success) {
-		FD_ZERO(&daemon->fds);
-		FD_SET(daemon->server_fd, &daemon->fds);
-		maxfd = daemon->server_fd;
-		nclients = 1;
-		for (i=0;i<daemon->slots;i++) {
-			if (daemon->client_fd[i] >= 0) {
-				FD_SET(daemon->client_fd[i], &daemon->fds);
-				maxfd = daemon->client_fd[i]>maxfd?daemon->client_fd[i]:maxfd;
-				nclients++;
+void *daemon_metrics_thread(void *arg)
+{
+	int fd;
+	daemon_metrics_t *metrics = (daemon_metrics_t *)arg;
+
+	for (;;) {
+		fd = accept4(metrics->fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
 			}
+			return NULL;
 		}
+		daemon_metrics_serve(metrics, fd);
+		close(fd);
+	}
+}
 
-		daemon_set_timeout(daemon, &timeout);
-		ready = select(maxfd+1, &daemon->fds, NULL, NULL, &timeout);
-		if (ready == 0) {
-			gettimeofday(&daemon->lasttick,NULL);
-			daemon->on_tick(daemon,tick);
-			tick = (tick+1) % daemon->ticks;
-		}
-		if (ready < 0) {
-			fprintf(stderr, "Could not select from sockets\n");
-			success = false;
-			break;
+daemon_metrics_t *daemon_metrics_start(daemon_t **shards, int nshards)
+{
+	int value;
+	struct sockaddr_in address;
+	daemon_metrics_t *metrics;
+
+	metrics = malloc(sizeof(*metrics));
+	metrics->shards = shards;
+	metrics->nshards = nshards;
+	metrics->fd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (metrics->fd < 0) {
+		fprintf(stderr, "Could not create metrics socket\n");
+		free(metrics);
+		return NULL;
+	}
+	value = 1;
+	setsockopt(metrics->fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
+	// a new process binds it while the old one still answers
+	setsockopt(metrics->fd, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value));
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(shards[0]->metrics_port);
+	address.sin_addr.s_addr = htonl(shards[0]->ip);
+	if (bind(metrics->fd, (const struct sockaddr *)&address, sizeof(address)) < 0 || listen(metrics->fd, 16) < 0) {
+		fprintf(stderr, "Could not listen on metrics port\n");
+		close(metrics->fd);
+		free(metrics);
+		return NULL;
+	}
+	if (pthread_create(&metrics->thread, NULL, daemon_metrics_thread, metrics) != 0) {
+		fprintf(stderr, "Could not start metrics thread\n");
+		close(metrics->fd);
+		free(metrics);
+		return NULL;
+	}
+	return metrics;
+}
+
+// shutting the listener down wakes the blocked accept
+void daemon_metrics_stop(daemon_metrics_t *metrics)
+{
+	shutdown(metrics->fd, SHUT_RDWR);
+	pthread_join(metrics->thread, NULL);
+	close(metrics->fd);
+	free(metrics);
+}
+
+// a message of the handoff with the descriptors attached to it
+bool daemon_handoff_send(int fd, void *bytes, size_t nbytes, int *fds, int nfds)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char bytes[CMSG_SPACE(DAEMON_HANDOFF_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+
+	memset(&msg,0,sizeof(msg));
+	iov.iov_base = bytes;
+	iov.iov_len = nbytes;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (nfds) {
+		msg.msg_control = control.bytes;
+		msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	}
+	return sendmsg(fd, &msg, MSG_NOSIGNAL) == (ssize_t)nbytes;
+}
+
+// the number of descriptors that came with a message of nbytes, or -1
+int daemon_handoff_recv(int fd, void *bytes, size_t nbytes, int *fds, int maxfds)
+{
+	int n;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char bytes[CMSG_SPACE(DAEMON_HANDOFF_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+
+	memset(&msg,0,sizeof(msg));
+	iov.iov_base = bytes;
+	iov.iov_len = nbytes;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.bytes;
+	msg.msg_controllen = CMSG_SPACE(maxfds * sizeof(int));
+	if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != (ssize_t)nbytes || (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC))) {
+		return -1;
+	}
+	n = 0;
+	for (cmsg=CMSG_FIRSTHDR(&msg);cmsg;cmsg=CMSG_NXTHDR(&msg,cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
 		}
-		// if server has data
-		if ((daemon->server_fd >= 0) && FD_ISSET(daemon->server_fd, &daemon->fds)) {
-
-			// new connection
-			for (i=0;i<daemon->slots;i++) {
-				if (daemon->client_fd[i] < 0) {
-
-					memset(&daemon->client_address[i], 0 ,sizeof(daemon->client_address[i]));
-					len = sizeof(daemon->client_address[i]);
-					daemon->client_fd[i] = accept(daemon->server_fd, (struct sockaddr *)&daemon->client_address[i], &len);
-					if (daemon->client_fd[i] < 0) {
-						fprintf(stderr, "accept failed\n");
-						break;
-					}
-					daemon->on_connect(daemon,i);
-					break;
-				}
-			}
-			if (i==daemon->slots) {
-				close(accept(daemon->server_fd, NULL, NULL));
-				fprintf(stderr, "client denied, max clients reached\n");
-			}
+	}
+	return n;
+}
+
+// the memfd with the number of descriptors, then those in batches
+bool daemon_handoff_send_state(int fd, daemon_state_t *state)
+{
+	int i, memfd;
+	uint32_t n;
+
+	n = state->nfds;
+	memfd = fileno(state->file);
+	if (!daemon_handoff_send(fd, &n, sizeof(n), &memfd, 1)) {
+		return false;
+	}
+	for (i=0;i<state->nfds;i+=n) {
+		n = state->nfds - i < DAEMON_HANDOFF_FDS ? state->nfds - i : DAEMON_HANDOFF_FDS;
+		if (!daemon_handoff_send(fd, &n, sizeof(n), state->fds + i, n)) {
+			return false;
 		}
-		/* check all connections */
-		for (i=0;i<daemon->slots;i++) {
-			// if client has data
-			if ((daemon->client_fd[i] >= 0) && FD_ISSET(daemon->client_fd[i], &daemon->fds)) {
-				daemon->on_data(daemon,i);
-			}
+	}
+	return true;
+}
+
+bool daemon_handoff_recv_state(int fd, daemon_state_t *state)
+{
+	int memfd, nfds;
+	uint32_t n;
+
+	if (daemon_handoff_recv(fd, &n, sizeof(n), &memfd, 1) != 1) {
+		return false;
+	}
+	// the old process left the offset at the end of what it wrote
+	lseek(memfd, 0, SEEK_SET);
+	state->file = fdopen(memfd, "r");
+	if (!state->file) {
+		close(memfd);
+		return false;
+	}
+	state->size = n;
+	state->fds = malloc((n ? n : 1) * sizeof(*state->fds));
+	while (state->nfds < state->size) {
+		nfds = daemon_handoff_recv(fd, &n, sizeof(n), state->fds + state->nfds, state->size - state->nfds < DAEMON_HANDOFF_FDS ? state->size - state->nfds : DAEMON_HANDOFF_FDS);
+		if (nfds <= 0 || nfds != (int)n) {
+			return false;
 		}
+		state->nfds += nfds;
 	}
+	return true;
+}
 
-	for (i=0;i<daemon->slots;i++) {
-		if (daemon->client_fd[i] >= 0) {
-			close(daemon->client_fd[i]);
+// neither process waits forever for the other
+void daemon_handoff_timeout(int fd)
+{
+	struct timeval timeout;
+
+	timeout.tv_sec = DAEMON_HANDOFF_TIMEOUT;
+	timeout.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// the new process is this program started with the same arguments, it
+// finds its end of the socket in the environment, built before the fork
+// as the child may only exec
+pid_t daemon_spawn(int *fd)
+{
+	int i, n, argc, envc, fds[2];
+	FILE *file;
+	pid_t pid;
+	char variable[32], *arguments, **argv, **envp;
+	static char cmdline[65536];
+
+	file = fopen("/proc/self/cmdline", "r");
+	if (!file) {
+		return -1;
+	}
+	n = fread(cmdline, 1, sizeof(cmdline)-1, file);
+	fclose(file);
+	cmdline[n] = 0;
+	argc = 0;
+	for (i=0;i<n;i++) {
+		argc += !cmdline[i];
+	}
+	if (!argc || socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, fds) < 0) {
+		return -1;
+	}
+	argv = malloc((argc + 1) * sizeof(*argv));
+	arguments = cmdline;
+	for (i=0;i<argc;i++) {
+		argv[i] = arguments;
+		arguments += strlen(arguments) + 1;
+	}
+	argv[argc] = NULL;
+	for (envc=0;environ[envc];envc++);
+	envp = malloc((envc + 2) * sizeof(*envp));
+	memcpy(envp, environ, envc * sizeof(*envp));
+	snprintf(variable, sizeof(variable), DAEMON_HANDOFF_ENV "=%d", fds[1]);
+	envp[envc] = variable;
+	envp[envc+1] = NULL;
+
+	// the upgrade signal stays blocked, one that comes early waits for the
+	// new process to be ready for it
+	pid = fork();
+	if (pid == 0) {
+		fcntl(fds[1], F_SETFD, 0);
+		execvpe(argv[0], argv, envp);
+		_exit(127);
+	}
+	free(envp);
+	free(argv);
+	close(fds[1]);
+	if (pid < 0) {
+		close(fds[0]);
+		return -1;
+	}
+	daemon_handoff_timeout(fds[0]);
+	*fd = fds[0];
+	return pid;
+}
+
+// every shard saves after its next tick, a shard that does not within the
+// timeout fails the upgrade
+bool daemon_handoff_collect(daemon_handoff_t *handoff)
+{
+	int i, result;
+	bool ready;
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += DAEMON_HANDOFF_TIMEOUT;
+	pthread_mutex_lock(&handoff->lock);
+	handoff->nready = 0;
+	__atomic_store_n(&handoff->state, handoff_saving, __ATOMIC_RELEASE);
+	result = 0;
+	while (handoff->nready < handoff->nshards && result != ETIMEDOUT) {
+		result = pthread_cond_timedwait(&handoff->cond, &handoff->lock, &deadline);
+	}
+	ready = handoff->nready == handoff->nshards;
+	pthread_mutex_unlock(&handoff->lock);
+	for (i=0;i<handoff->nshards && ready;i++) {
+		ready = !handoff->states[i].failed;
+	}
+	return ready;
+}
+
+// true when the new process took over, the shards only stop for a new
+// process that says it can, and go on when it fails after all
+bool daemon_upgrade(daemon_handoff_t *handoff)
+{
+	int i;
+	char ack;
+	pid_t pid;
+	bool done;
+	uint64_t start;
+	daemon_hello_t hello;
+
+	pid = daemon_spawn(&handoff->fd);
+	if (pid < 0) {
+		fprintf(stderr, "Could not start new process\n");
+		return false;
+	}
+	done = false;
+	start = 0;
+	if (recv(handoff->fd, &hello, sizeof(hello), 0) != sizeof(hello) || hello.version != DAEMON_STATE_VERSION
+			|| hello.shards != (uint32_t)handoff->nshards || hello.slots != handoff->shards[0]->slots) {
+		fprintf(stderr, "New process cannot take over\n");
+	} else {
+		done = daemon_handoff_collect(handoff);
+		// from here on no shard runs until the new process took over
+		start = daemon_clock();
+		for (i=0;i<handoff->nshards && done;i++) {
+			done = daemon_handoff_send_state(handoff->fd, &handoff->states[i]);
 		}
+		done = done && recv(handoff->fd, &ack, sizeof(ack), 0) == sizeof(ack) && ack;
 	}
-	close(daemon->server_fd);
-	daemon_destroy(daemon);
+	pthread_mutex_lock(&handoff->lock);
+	__atomic_store_n(&handoff->state, done ? handoff_done : handoff_idle, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&handoff->cond);
+	pthread_mutex_unlock(&handoff->lock);
+	close(handoff->fd);
+	handoff->fd = -1;
+	if (!done) {
+		// it might have started without telling, it must not run next to us
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		fprintf(stderr, "Upgrade failed, going on\n");
+		return false;
+	}
+	fprintf(stderr, "Handed over to process %d in %llu us\n", (int)pid, (unsigned long long)(daemon_clock() - start)/1000);
+	return true;
+}
+
+// the only thread that takes the upgrade signal, it is blocked in all others
+void *daemon_handoff_thread(void *arg)
+{
+	int signal;
+	sigset_t signals;
+	daemon_handoff_t *handoff = (daemon_handoff_t *)arg;
 
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR2);
+	for (;;) {
+		if (sigwait(&signals, &signal) == 0 && daemon_upgrade(handoff)) {
+			return NULL;
+		}
+	}
+}
+
+daemon_handoff_t *daemon_handoff_create(daemon_t **shards, int nshards)
+{
+	int i;
+	char *variable;
+	daemon_handoff_t *handoff;
+
+	handoff = malloc(sizeof(*handoff));
+	memset(handoff,0,sizeof(*handoff));
+	pthread_mutex_init(&handoff->lock, NULL);
+	pthread_cond_init(&handoff->cond, NULL);
+	handoff->nshards = nshards;
+	handoff->shards = shards;
+	handoff->states = calloc(nshards, sizeof(*handoff->states));
+	handoff->fd = -1;
+	for (i=0;i<nshards;i++) {
+		shards[i]->handoff = handoff;
+	}
+	// started by an old process to take over from it
+	variable = getenv(DAEMON_HANDOFF_ENV);
+	if (variable) {
+		handoff->fd = atoi(variable);
+		handoff->adopting = true;
+		unsetenv(DAEMON_HANDOFF_ENV);
+		fcntl(handoff->fd, F_SETFD, FD_CLOEXEC);
+		daemon_handoff_timeout(handoff->fd);
+	}
+	return handoff;
+}
+
+// tells the old process what this one runs, and takes what every shard saved
+bool daemon_handoff_receive(daemon_handoff_t *handoff)
+{
+	int i;
+	daemon_hello_t hello;
+
+	hello.version = DAEMON_STATE_VERSION;
+	hello.shards = handoff->nshards;
+	hello.slots = handoff->shards[0]->slots;
+	if (send(handoff->fd, &hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello)) {
+		fprintf(stderr, "Could not reach the old process\n");
+		return false;
+	}
+	for (i=0;i<handoff->nshards;i++) {
+		if (!daemon_handoff_recv_state(handoff->fd, &handoff->states[i])) {
+			fprintf(stderr, "Could not take over from the old process\n");
+			return false;
+		}
+	}
+	return true;
+}
+
+// the thread only ends by itself after a handoff, otherwise it is waiting
+void daemon_handoff_destroy(daemon_handoff_t *handoff)
+{
+	int i;
+
+	if (handoff->running) {
+		pthread_cancel(handoff->thread);
+		pthread_join(handoff->thread, NULL);
+	}
+	if (handoff->fd >= 0) {
+		close(handoff->fd);
+	}
+	for (i=0;i<handoff->nshards;i++) {
+		daemon_state_clear(&handoff->states[i]);
+	}
+	free(handoff->states);
+	pthread_cond_destroy(&handoff->cond);
+	pthread_mutex_destroy(&handoff->lock);
+	free(handoff);
+}
+
+// every shard is a full copy with its own listener, loop and game state
+daemon_t *daemon_shard(daemon_t *daemon, int i)
+{
+	daemon_t *shard;
+
+	shard = daemon_create(daemon->ip, daemon->port, daemon->slots, daemon->ticks);
+	shard->backend = daemon->backend;
+	shard->queue_limit = daemon->queue_limit;
+	shard->evict_ticks = daemon->evict_ticks;
+	shard->max_catchup = daemon->max_catchup;
+	shard->shards = daemon->shards;
+	shard->pin_cpus = daemon->pin_cpus;
+	shard->backlog = daemon->backlog;
+	shard->accept_budget = daemon->accept_budget;
+	shard->zerocopy_min = daemon->zerocopy_min;
+	shard->metrics_port = daemon->metrics_port;
+	shard->watch_port = daemon->watch_port;
+	shard->shard = i;
+	shard->context = daemon->context;
+	shard->on_start = daemon->on_start;
+	shard->on_connect = daemon->on_connect;
+	shard->on_disconnect = daemon->on_disconnect;
+	shard->on_data = daemon->on_data;
+	shard->on_tick = daemon->on_tick;
+	shard->on_resync = daemon->on_resync;
+	shard->on_save = daemon->on_save;
+	shard->on_load = daemon->on_load;
+	return shard;
+}
+
+// the first shard runs on the calling thread, all of them are destroyed
+// only after every loop ended, so the metrics thread can read them
+bool daemon_run(daemon_t *daemon)
+{
+	int i, nshards, nthreads;
+	bool success;
+	daemon_t **shards;
+	pthread_t *threads;
+	daemon_metrics_t *metrics;
+	daemon_handoff_t *handoff;
+	sigset_t signals;
+	void *result;
+
+	nshards = daemon->shards > 1 ? daemon->shards : 1;
+	shards = malloc(nshards * sizeof(*shards));
+	threads = malloc(nshards * sizeof(*threads));
+	shards[0] = daemon;
+	for (i=1;i<nshards;i++) {
+		shards[i] = daemon_shard(daemon, i);
+	}
+	// SIGUSR2 upgrades to the program as it is on disk now, the threads
+	// started from here have it blocked
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	handoff = daemon_handoff_create(shards, nshards);
+	success = !handoff->adopting || daemon_handoff_receive(handoff);
+	metrics = NULL;
+	if (success && daemon->metrics_port) {
+		metrics = daemon_metrics_start(shards, nshards);
+		success = metrics != NULL;
+	}
+	nthreads = 1;
+	for (i=1;i<nshards && success;i++) {
+		if (pthread_create(&threads[i], NULL, daemon_thread, shards[i]) != 0) {
+			fprintf(stderr, "Could not start shard %d\n", i);
+			success = false;
+			break;
+		}
+		nthreads++;
+	}
+	if (success) {
+		handoff->running = pthread_create(&handoff->thread, NULL, daemon_handoff_thread, handoff) == 0;
+		if (!handoff->running) {
+			fprintf(stderr, "Could not start handoff thread, upgrades are off\n");
+		}
+		success = daemon_loop(daemon);
+	}
+	for (i=1;i<nthreads;i++) {
+		pthread_join(threads[i], &result);
+		success = success && result;
+	}
+	daemon_handoff_destroy(handoff);
+	if (metrics) {
+		daemon_metrics_stop(metrics);
+	}
+	for (i=0;i<nshards;i++) {
+		daemon_destroy(shards[i]);
+	}
+	free(threads);
+	free(shards);
 	return success;
 }
 
 void daemon_on_tick(daemon_t *daemon, int tick)
 {
-	fprintf(stdout,".");
-	fflush(stdout);
 }
 
 void daemon_on_data(daemon_t *daemon, int client)
@@ -203,11 +2643,8 @@ void daemon_on_data(daemon_t *daemon, int client)
 	int nbytes;
 	char bytes[1024];
 
-	fprintf(stdout,"#%d",client);
-	fflush(stdout);
-
 	nbytes = daemon_read(daemon, client, bytes, sizeof(bytes));
-	if (nbytes) {
+	if (nbytes > 0) {
 		daemon_write(daemon, client, bytes, nbytes);
 	}
 }
@@ -217,12 +2654,6 @@ void daemon_on_connect(daemon_t *daemon, int client)
 	int nbytes;
 	char *bytes;
 
-	uint8_t *addr = (uint8_t *)&daemon->client_address[client].sin_addr.s_addr;
-	uint16_t *port = (uint16_t *)&daemon->client_address[client].sin_port;
-
-	fprintf(stdout,"#%d[%d.%d.%d.%d:%d]",client,addr[0],addr[1],addr[2],addr[3],*port);
-	fflush(stdout);
-
 	bytes = "Welcome\n";
 	nbytes = strlen(bytes);
 
@@ -231,11 +2662,26 @@ void daemon_on_connect(daemon_t *daemon, int client)
 
 void daemon_on_disconnect(daemon_t *daemon, int client)
 {
-	fprintf(stdout,"[disconnect]");
-	fflush(stdout);
 }
 
-daemon_t *daemon_create(uint32_t ip, uint16_t port, uint16_t slots, uint8_t ticks)
+void daemon_on_resync(daemon_t *daemon, int client)
+{
+}
+
+void daemon_on_start(daemon_t *daemon)
+{
+}
+
+void daemon_on_save(daemon_t *daemon, daemon_state_t *state)
+{
+}
+
+bool daemon_on_load(daemon_t *daemon, daemon_state_t *state)
+{
+	return true;
+}
+
+daemon_t *daemon_create(uint32_t ip, uint16_t port, uint16_t slots, uint16_t ticks)
 {
 	daemon_t *daemon;
 	int i;
@@ -247,20 +2693,44 @@ daemon_t *daemon_create(uint32_t ip, uint16_t port, uint16_t slots, uint8_t tick
 	daemon->port = port;
 	daemon->slots = slots;
 	daemon->ticks = ticks;
+	daemon->queue_limit = 65536;
+	daemon->evict_ticks = ticks*5;
+	daemon->max_catchup = 5;
+	daemon->shards = 1;
+	daemon->backlog = SOMAXCONN;
+	daemon->accept_budget = 64;
+	daemon->zerocopy_min = 32768;
 	// public variables
 	memset(&daemon->server_address,0,sizeof(daemon->server_address));
 	daemon->client_address = malloc(slots * sizeof(*daemon->client_address));
 	memset(daemon->client_address,0,slots * sizeof(*daemon->client_address));
 	// private variables
 	daemon->server_fd = -1;
+	daemon->watch_fd = -1;
+	daemon->client_spectator = calloc(slots, sizeof(*daemon->client_spectator));
+	daemon->client_binary = calloc(slots, sizeof(*daemon->client_binary));
 	daemon->client_fd = malloc(slots * sizeof(*daemon->client_fd));
+	daemon->client_queue = malloc(slots * sizeof(*daemon->client_queue));
+	memset(daemon->client_queue,0,slots * sizeof(*daemon->client_queue));
+	daemon->client_input = malloc(slots * sizeof(*daemon->client_input));
+	memset(daemon->client_input,0,slots * sizeof(*daemon->client_input));
+	daemon->free_slots = malloc(slots * sizeof(*daemon->free_slots));
+	// free slots are a stack, so the lowest slot is handed out first
 	for (i=0;i<slots;i++) {
 		daemon->client_fd[i] = -1;
+		daemon->free_slots[i] = slots-1-i;
 	}
+	daemon->nfree = slots;
+	daemon->epoll_fd = -1;
+	daemon->timer_fd = -1;
 	// event handlers
 	daemon->on_tick = daemon_on_tick;
 	daemon->on_data = daemon_on_data;
 	daemon->on_connect = daemon_on_connect;
 	daemon->on_disconnect = daemon_on_disconnect;
+	daemon->on_resync = daemon_on_resync;
+	daemon->on_start = daemon_on_start;
+	daemon->on_save = daemon_on_save;
+	daemon->on_load = daemon_on_load;
 	return daemon;
 }
@@ -12,39 +12,173 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <sys/time.h>
+#include <sys/select.h>
 #include <arpa/inet.h>
 
 typedef struct daemon_t daemon_t;
+typedef struct daemon_frame_t daemon_frame_t;
+typedef struct daemon_ring_t daemon_ring_t;
+typedef struct daemon_queue_t daemon_queue_t;
+typedef struct daemon_uring_t daemon_uring_t;
+typedef struct daemon_input_t daemon_input_t;
+typedef struct daemon_state_t daemon_state_t;
+typedef struct daemon_handoff_t daemon_handoff_t;
+
+// bytes of input kept per client, a power of two
+#define DAEMON_INPUT 256
+
+// buckets of the tick duration histogram, from 100us to 100ms
+#define DAEMON_TICK_BUCKETS 7
+
+// layout of the state handed to a new process, one that finds another
+// version refuses the handoff and the old process keeps running
+#define DAEMON_STATE_VERSION 1
+
+// event loop implementations, auto picks epoll and falls back to select,
+// uring falls back to epoll on kernels without the needed io_uring features
+enum daemon_backends { backend_auto, backend_select, backend_epoll, backend_uring };
+
+// immutable output, shared by the queues of all clients it is sent to
+struct daemon_frame_t {
+	int refs;
+	// set by the game to learn which frame a client has seen, 0 for none
+	uint64_t id;
+	int nbytes;
+	char bytes[];
+};
+
+struct daemon_ring_t {
+	daemon_frame_t **frames;
+	int size;
+	int first;
+	int count;
+};
+
+// pending output of a client, written whenever the socket accepts more
+struct daemon_queue_t {
+	daemon_ring_t frames;
+	int offset;
+	int nbytes;
+	bool resync;
+	uint64_t resync_tick;
+	// id of the last frame with an id that was sent completely
+	uint64_t last_frame;
+	// frames the kernel may still read from after a zero copy send
+	bool zerocopy;
+	uint32_t zerocopy_seq;
+	daemon_ring_t zerocopy_frames;
+	// output that left the queue since the client connected
+	uint64_t bytes_sent;
+	uint64_t frames_sent;
+};
+
+// received bytes of a client that on_data has not consumed yet
+struct daemon_input_t {
+	int first;
+	int count;
+	char bytes[DAEMON_INPUT];
+};
 
 struct daemon_t {
 	// initialization values
 	uint32_t ip;
 	uint16_t port;
 	uint16_t slots;
-	uint8_t ticks;
+	uint16_t ticks;
+	uint8_t backend;
+	uint32_t queue_limit;
+	uint32_t evict_ticks;
+	uint32_t max_catchup;
+	uint16_t shards;
+	bool pin_cpus;
+	int backlog;
+	uint32_t accept_budget;
+	uint32_t zerocopy_min;
+	// serves the counters of all shards as prometheus text when set
+	uint16_t metrics_port;
+	// clients of this port, when set, are marked as spectators
+	uint16_t watch_port;
 	// public variables
 	void *context;
+	uint16_t shard;
+	// tick scheduler statistics, in nanoseconds
+	uint64_t tick_lateness;
+	uint64_t tick_jitter;
+	uint64_t ticks_missed;
+	// time spent in on_tick, the buckets are not cumulative
+	uint64_t tick_time;
+	uint64_t tick_buckets[DAEMON_TICK_BUCKETS];
+	// returns from select, epoll_wait or io_uring_enter
+	uint64_t wakeups;
+	// connections served, turned away with a notice, and lost on errors
+	uint64_t accepted;
+	uint64_t refused;
+	uint64_t dropped;
+	uint64_t disconnected;
+	// output of clients that are gone, connected ones count in their queue
+	uint64_t bytes_sent;
+	uint64_t frames_sent;
 	struct sockaddr_in server_address;
 	struct sockaddr_in *client_address;
+	bool *client_spectator;
+	// set by the game for clients that asked for its binary protocol
+	bool *client_binary;
 	// private variables
 	int server_fd;
+	int watch_fd;
 	int *client_fd;
+	daemon_queue_t *client_queue;
+	daemon_input_t *client_input;
+	int *free_slots;
+	int nfree;
+	int epoll_fd;
+	int nevents;
+	struct epoll_event *events;
+	daemon_uring_t *uring;
 	fd_set fds;
-	struct timeval lasttick;
+	fd_set wfds;
+	int timer_fd;
+	uint64_t tick_period;
+	uint64_t next_tick;
+	uint64_t tick_count;
+	// an upgrade to a new process, shared by all shards
+	daemon_handoff_t *handoff;
 	// event handlers
 	void (*on_connect)(daemon_t *daemon, int client);
 	void (*on_disconnect)(daemon_t *daemon, int client);
 	void (*on_data)(daemon_t *daemon, int client);
 	void (*on_tick)(daemon_t *daemon, int tick);
+	void (*on_resync)(daemon_t *daemon, int client);
+	// called on the shard's own thread before its loop starts
+	void (*on_start)(daemon_t *daemon);
+	// the state of the game for the process that takes over, saved once the
+	// loop stopped after a tick, loaded in the new process after on_start
+	void (*on_save)(daemon_t *daemon, daemon_state_t *state);
+	bool (*on_load)(daemon_t *daemon, daemon_state_t *state);
 };
 
-daemon_t *daemon_create(uint32_t ip, uint16_t port, uint16_t slots, uint8_t ticks);
+daemon_t *daemon_create(uint32_t ip, uint16_t port, uint16_t slots, uint16_t ticks);
 bool daemon_run(daemon_t *daemon);
+// only for a daemon that never ran, daemon_run destroys its own
+void daemon_destroy(daemon_t *daemon);
 
 // public functions
 void daemon_disconnect(daemon_t *daemon, int client);
 int daemon_read(daemon_t *daemon, int client, char *bytes, int nbytes);
 int daemon_write(daemon_t *daemon, int client, char *bytes, int nbytes);
+daemon_frame_t *daemon_frame_create(char *bytes, int nbytes);
+void daemon_frame_release(daemon_frame_t *frame);
+int daemon_write_frame(daemon_t *daemon, int client, daemon_frame_t *frame);
+uint64_t daemon_last_frame(daemon_t *daemon, int client);
+void daemon_broadcast(daemon_t *daemon, daemon_frame_t *frame, int *clients, int nclients);
+
+// the state is read back in the order it was saved, descriptors apart from
+// the bytes, a load that runs out fails and so does every load after it
+void daemon_save(daemon_state_t *state, const void *bytes, size_t nbytes);
+bool daemon_load(daemon_state_t *state, void *bytes, size_t nbytes);
+void daemon_save_fd(daemon_state_t *state, int fd);
+int daemon_load_fd(daemon_state_t *state);
 
 #endif /* DAEMON_H_ */
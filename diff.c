@@ -0,0 +1,227 @@
+/*
+ ============================================================================
+ Name        : diff.c
+ Description : Finds the runs of cells that differ between two boards
+ Author      : Maurits van der Schee <maurits@vdschee.nl>
+ URL         : https://github.com/mevdschee/daemon-games
+ ============================================================================
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "diff.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIFF_X86
+#endif
+
+bool diff_supported(int kernel)
+{
+	switch (kernel) {
+		case kernel_auto:
+		case kernel_scalar:
+			return true;
+#ifdef DIFF_X86
+		case kernel_sse2:
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("sse2");
+		case kernel_avx2:
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("avx2");
+#endif
+	}
+	return false;
+}
+
+// a differing cell extends the last run when it is right behind it
+static inline void diff_mark(diff_t *diff, int i)
+{
+	diff_run_t *run;
+
+	if (diff->nruns) {
+		run = &diff->runs[diff->nruns-1];
+		if (run->start + run->length == i) {
+			run->length++;
+			return;
+		}
+	}
+	if (diff->nruns == diff->size) {
+		diff->size = diff->size ? diff->size*2 : 64;
+		diff->runs = realloc(diff->runs,diff->size*sizeof(*diff->runs));
+	}
+	diff->runs[diff->nruns].start = i;
+	diff->runs[diff->nruns].length = 1;
+	diff->nruns++;
+}
+
+static inline void diff_cells(diff_t *diff, const uint32_t *a, const uint32_t *b, int from, int to, uint32_t mask)
+{
+	int i;
+
+	for (i=from;i<to;i++) {
+		if ((a[i] ^ b[i]) & mask) {
+			diff_mark(diff,i);
+		}
+	}
+}
+
+// two cells per compare in a plain 64 bit word, for any cpu
+int diff_scalar(diff_t *diff, const uint32_t *a, const uint32_t *b, int n, uint32_t mask)
+{
+	int i;
+	uint64_t x, y, masks;
+
+	masks = mask * 0x0000000100000001ULL;
+	for (i=0;i+2<=n;i+=2) {
+		memcpy(&x,a+i,sizeof(x));
+		memcpy(&y,b+i,sizeof(y));
+		if ((x ^ y) & masks) {
+			diff_cells(diff,a,b,i,i+2,mask);
+		}
+	}
+	diff_cells(diff,a,b,i,n,mask);
+	return diff->nruns;
+}
+
+#ifdef DIFF_X86
+// the byte mask of a vector compare has four bits for every differing cell
+static inline void diff_mark_bits(diff_t *diff, int i, uint32_t bits)
+{
+	int bit;
+
+	while (bits) {
+		bit = __builtin_ctz(bits);
+		diff_mark(diff,i+bit/4);
+		bits &= ~(15U << bit);
+	}
+}
+
+__attribute__((target("sse2")))
+static inline __m128i diff_xor_sse2(const uint32_t *a, const uint32_t *b, __m128i masks)
+{
+	return _mm_and_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i *)a),_mm_loadu_si128((const __m128i *)b)),masks);
+}
+
+__attribute__((target("sse2")))
+static inline void diff_vector_sse2(diff_t *diff, const uint32_t *a, const uint32_t *b, int i, __m128i masks)
+{
+	uint32_t bits;
+
+	bits = ~_mm_movemask_epi8(_mm_cmpeq_epi32(diff_xor_sse2(a+i,b+i,masks),_mm_setzero_si128())) & 0xFFFF;
+	if (bits) {
+		diff_mark_bits(diff,i,bits);
+	}
+}
+
+// unchanged stretches are skipped four vectors at a time
+__attribute__((target("sse2")))
+int diff_sse2(diff_t *diff, const uint32_t *a, const uint32_t *b, int n, uint32_t mask)
+{
+	int i, j;
+	__m128i x, masks;
+
+	masks = _mm_set1_epi32((int)mask);
+	for (i=0;i+16<=n;i+=16) {
+		x = _mm_or_si128(_mm_or_si128(diff_xor_sse2(a+i,b+i,masks),diff_xor_sse2(a+i+4,b+i+4,masks)),
+				_mm_or_si128(diff_xor_sse2(a+i+8,b+i+8,masks),diff_xor_sse2(a+i+12,b+i+12,masks)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(x,_mm_setzero_si128())) == 0xFFFF) {
+			continue;
+		}
+		for (j=0;j<16;j+=4) {
+			diff_vector_sse2(diff,a,b,i+j,masks);
+		}
+	}
+	for (;i+4<=n;i+=4) {
+		diff_vector_sse2(diff,a,b,i,masks);
+	}
+	diff_cells(diff,a,b,i,n,mask);
+	return diff->nruns;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i diff_xor_avx2(const uint32_t *a, const uint32_t *b, __m256i masks)
+{
+	return _mm256_and_si256(_mm256_xor_si256(_mm256_loadu_si256((const __m256i *)a),_mm256_loadu_si256((const __m256i *)b)),masks);
+}
+
+__attribute__((target("avx2")))
+static inline void diff_vector_avx2(diff_t *diff, const uint32_t *a, const uint32_t *b, int i, __m256i masks)
+{
+	uint32_t bits;
+
+	bits = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi32(diff_xor_avx2(a+i,b+i,masks),_mm256_setzero_si256()));
+	if (bits) {
+		diff_mark_bits(diff,i,bits);
+	}
+}
+
+__attribute__((target("avx2")))
+int diff_avx2(diff_t *diff, const uint32_t *a, const uint32_t *b, int n, uint32_t mask)
+{
+	int i, j;
+	__m256i x, masks;
+
+	masks = _mm256_set1_epi32((int)mask);
+	for (i=0;i+32<=n;i+=32) {
+		x = _mm256_or_si256(_mm256_or_si256(diff_xor_avx2(a+i,b+i,masks),diff_xor_avx2(a+i+8,b+i+8,masks)),
+				_mm256_or_si256(diff_xor_avx2(a+i+16,b+i+16,masks),diff_xor_avx2(a+i+24,b+i+24,masks)));
+		if (_mm256_testz_si256(x,x)) {
+			continue;
+		}
+		for (j=0;j<32;j+=8) {
+			diff_vector_avx2(diff,a,b,i+j,masks);
+		}
+	}
+	for (;i+8<=n;i+=8) {
+		diff_vector_avx2(diff,a,b,i,masks);
+	}
+	diff_cells(diff,a,b,i,n,mask);
+	return diff->nruns;
+}
+#endif
+
+// the cpu is asked once per diff, not on every compare
+diff_kernel_t diff_kernel(int kernel)
+{
+	if (kernel == kernel_auto) {
+		kernel = diff_supported(kernel_avx2) ? kernel_avx2 : diff_supported(kernel_sse2) ? kernel_sse2 : kernel_scalar;
+	}
+	switch (kernel) {
+#ifdef DIFF_X86
+		case kernel_sse2: return diff_sse2;
+		case kernel_avx2: return diff_avx2;
+#endif
+	}
+	return diff_scalar;
+}
+
+diff_t *diff_create()
+{
+	diff_t *diff = malloc(sizeof(*diff));
+
+	diff->runs = NULL;
+	diff->nruns = 0;
+	diff->size = 0;
+	diff->kernel = diff_kernel(kernel_auto);
+	return diff;
+}
+
+void diff_destroy(diff_t *diff)
+{
+	free(diff->runs);
+	free(diff);
+}
+
+int diff_words_with(diff_t *diff, int kernel, const uint32_t *a, const uint32_t *b, int n, uint32_t mask)
+{
+	diff->nruns = 0;
+	return diff_kernel(kernel)(diff,a,b,n,mask);
+}
+
+int diff_words(diff_t *diff, const uint32_t *a, const uint32_t *b, int n, uint32_t mask)
+{
+	diff->nruns = 0;
+	return diff->kernel(diff,a,b,n,mask);
+}
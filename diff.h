@@ -0,0 +1,50 @@
+/*
+ ============================================================================
+ Name        : diff.h
+ Description : Finds the runs of cells that differ between two boards
+ Author      : Maurits van der Schee <maurits@vdschee.nl>
+ URL         : https://github.com/mevdschee/daemon-games
+ ============================================================================
+ */
+
+#ifndef DIFF_H_
+#define DIFF_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct diff_t diff_t;
+typedef struct diff_run_t diff_run_t;
+typedef int (*diff_kernel_t)(diff_t *diff, const uint32_t *a, const uint32_t *b, int n, uint32_t mask);
+
+// auto picks the widest kernel the cpu runs
+enum diff_kernels { kernel_auto, kernel_scalar, kernel_sse2, kernel_avx2 };
+
+// length cells from start on differ
+struct diff_run_t {
+	int start;
+	int length;
+};
+
+// the runs of the last compare, the array grows to the largest diff
+struct diff_t {
+	diff_run_t *runs;
+	int nruns;
+	int size;
+	// the widest kernel the cpu runs, picked once
+	diff_kernel_t kernel;
+};
+
+diff_t *diff_create();
+
+void diff_destroy(diff_t *diff);
+
+bool diff_supported(int kernel);
+
+// compare n words in the bits of mask, returns the number of runs found
+int diff_words(diff_t *diff, const uint32_t *a, const uint32_t *b, int n, uint32_t mask);
+
+// the same with the given kernel, which has to be supported
+int diff_words_with(diff_t *diff, int kernel, const uint32_t *a, const uint32_t *b, int n, uint32_t mask);
+
+#endif /* DIFF_H_ */
@@ -0,0 +1,625 @@
+/*
+ ============================================================================
+ Name        : loadgen.c
+ Description : Headless bot clients that measure the frames they receive
+ Author      : Maurits van der Schee <maurits@vdschee.nl>
+ URL         : https://github.com/mevdschee/daemon-games
+ ============================================================================
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+typedef struct loadgen_t loadgen_t;
+typedef struct loadgen_client_t loadgen_client_t;
+typedef struct loadgen_samples_t loadgen_samples_t;
+
+// messages, events and cell kinds of the binary protocol of snaked
+enum loadgen_messages { message_keyframe = 1, message_delta, message_seat };
+enum loadgen_events { event_join, event_leave, event_eat, event_die };
+enum loadgen_kinds { kind_empty, kind_food, kind_head };
+
+// asks for the binary protocol, which starts when the server sends it back
+#define LOADGEN_BINARY 0xfe
+
+// turns the server queues for a snake, more keys are dropped
+#define LOADGEN_TURNS 4
+
+// measurements in microseconds
+struct loadgen_samples_t {
+	uint32_t *values;
+	int count;
+	int size;
+};
+
+struct loadgen_client_t {
+	int fd;
+	bool connected;
+	// bytes of the current frame so far
+	int nbytes;
+	// the server ends its frames with a zero byte, otherwise every read is one
+	bool delimited;
+	// binary messages start after the answer, each with a varint length
+	bool acked;
+	uint32_t length;
+	int shift;
+	uint32_t remaining;
+	// the binary message that is coming in
+	unsigned char *message;
+	uint32_t message_size;
+	uint32_t received;
+	uint64_t last_frame;
+	// the snake of the bot, its direction as last seen and the turns it
+	// asked for that did not show up yet, 0 while it has no snake
+	bool seated;
+	uint32_t seat;
+	int direction;
+	int nturns;
+	int turns[LOADGEN_TURNS];
+	uint64_t turn_times[LOADGEN_TURNS];
+	uint64_t next_key;
+	int key;
+	// text mode times a key until it is echoed, echoes come in the order of
+	// the keys, the send times of the last ones are in turn_times
+	uint32_t nsent;
+	uint32_t nechoed;
+};
+
+struct loadgen_t {
+	// options
+	struct sockaddr_in address;
+	int nclients;
+	int seconds;
+	int rate;
+	char *script;
+	bool binary;
+	// state
+	int epoll_fd;
+	loadgen_client_t *clients;
+	// results
+	uint64_t frames;
+	uint64_t bytes;
+	int max_frame;
+	int keys;
+	int failed;
+	int disconnected;
+	loadgen_samples_t intervals;
+	loadgen_samples_t latencies;
+};
+
+uint64_t loadgen_clock()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void loadgen_sample(loadgen_samples_t *samples, uint64_t nsec)
+{
+	if (samples->count == samples->size) {
+		samples->size = samples->size ? samples->size * 2 : 1024;
+		samples->values = realloc(samples->values, samples->size * sizeof(*samples->values));
+	}
+	samples->values[samples->count++] = nsec / 1000;
+}
+
+int loadgen_compare(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+void loadgen_report(const char *name, loadgen_samples_t *samples)
+{
+	int i;
+	double mean, variance;
+	uint32_t *values = samples->values;
+
+	if (!samples->count) {
+		fprintf(stdout, "%-9s no samples\n", name);
+		return;
+	}
+	qsort(values, samples->count, sizeof(*values), loadgen_compare);
+	mean = 0;
+	for (i=0;i<samples->count;i++) {
+		mean += values[i];
+	}
+	mean /= samples->count;
+	variance = 0;
+	for (i=0;i<samples->count;i++) {
+		variance += (values[i] - mean) * (values[i] - mean);
+	}
+	variance /= samples->count;
+	fprintf(stdout, "%-9s ms mean %.2f p50 %.2f p99 %.2f max %.2f stddev %.2f (%d samples)\n", name,
+			mean / 1000, values[samples->count / 2] / 1000.0, values[samples->count * 99 / 100] / 1000.0,
+			values[samples->count - 1] / 1000.0, sqrt(variance) / 1000, samples->count);
+}
+
+void loadgen_close(loadgen_t *loadgen, loadgen_client_t *client)
+{
+	if (client->connected) {
+		loadgen->disconnected++;
+	} else {
+		loadgen->failed++;
+	}
+	close(client->fd);
+	client->fd = -1;
+	client->connected = false;
+}
+
+void loadgen_frame(loadgen_t *loadgen, loadgen_client_t *client, uint64_t now)
+{
+	loadgen->frames++;
+	loadgen->bytes += client->nbytes;
+	if (client->nbytes > loadgen->max_frame) {
+		loadgen->max_frame = client->nbytes;
+	}
+	if (client->last_frame) {
+		loadgen_sample(&loadgen->intervals, now - client->last_frame);
+	}
+	client->last_frame = now;
+	client->nbytes = 0;
+}
+
+// the bytes a bot sends as keys, frames are escape sequences and glyphs
+bool loadgen_is_key(loadgen_t *loadgen, char c)
+{
+	return c && strchr(loadgen->script ? loadgen->script : "wasd", c);
+}
+
+// a key that comes back answers the oldest one that did not yet, a key
+// sent too long ago to still have its time gives no sample
+void loadgen_echoed(loadgen_t *loadgen, loadgen_client_t *client, uint64_t now)
+{
+	if (client->nechoed == client->nsent) {
+		return;
+	}
+	if (client->nsent - client->nechoed <= LOADGEN_TURNS) {
+		loadgen_sample(&loadgen->latencies, now - client->turn_times[client->nechoed % LOADGEN_TURNS]);
+	}
+	client->nechoed++;
+}
+
+// a text frame ends in a zero byte, without those every read is one
+void loadgen_parse(loadgen_t *loadgen, loadgen_client_t *client, char *bytes, int nbytes, uint64_t now)
+{
+	int i;
+
+	for (i=0;i<nbytes;i++) {
+		if (!bytes[i]) {
+			client->delimited = true;
+			loadgen_frame(loadgen, client, now);
+			continue;
+		}
+		if (loadgen_is_key(loadgen, bytes[i])) {
+			loadgen_echoed(loadgen, client, now);
+		}
+		client->nbytes++;
+	}
+	if (!client->delimited && client->nbytes) {
+		loadgen_frame(loadgen, client, now);
+	}
+}
+
+bool loadgen_varint(const unsigned char **p, const unsigned char *end, uint32_t *value)
+{
+	int shift;
+
+	*value = 0;
+	for (shift=0;shift<32 && *p<end;shift+=7) {
+		*value |= (uint32_t)(**p & 0x7f) << shift;
+		if (!(*(*p)++ & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// directions are 1 down, 2 up, 3 right and 4 left
+int loadgen_opposite(int direction)
+{
+	return ((direction - 1) ^ 1) + 1;
+}
+
+// the head of the bot turned, which answers the turns it asked for up to
+// that one, any other turn means the bot lost track and starts over
+void loadgen_turned(loadgen_t *loadgen, loadgen_client_t *client, int direction, uint64_t now)
+{
+	int i, j;
+
+	if (direction == client->direction) {
+		return;
+	}
+	client->direction = direction;
+	for (i=0;i<client->nturns && client->turns[i] != direction;i++);
+	if (i == client->nturns) {
+		client->nturns = 0;
+		return;
+	}
+	for (j=0;j<=i;j++) {
+		loadgen_sample(&loadgen->latencies, now - client->turn_times[j]);
+	}
+	client->nturns -= i + 1;
+	memmove(client->turns, client->turns + i + 1, client->nturns * sizeof(*client->turns));
+	memmove(client->turn_times, client->turn_times + i + 1, client->nturns * sizeof(*client->turn_times));
+}
+
+// only the seat, the events of that seat and the head of its snake matter,
+// a cell is its kind plus 8 times the direction plus 64 times the seat
+void loadgen_message(loadgen_t *loadgen, loadgen_client_t *client, uint64_t now)
+{
+	int i;
+	uint32_t type, value, seat, n;
+	const unsigned char *p = client->message, *end = client->message + client->received;
+
+	if (p == end) {
+		return;
+	}
+	type = *p++;
+	n = 0;
+	switch (type) {
+		case message_seat:
+			client->seated = loadgen_varint(&p, end, &client->seat);
+			client->direction = 0;
+			client->nturns = 0;
+			return;
+		case message_keyframe:
+			n = 6;
+			break;
+		case message_delta:
+			n = 2;
+			break;
+		default:
+			return;
+	}
+	for (i=0;i<(int)n;i++) {
+		loadgen_varint(&p, end, &value);
+	}
+	if (type == message_delta && loadgen_varint(&p, end, &n)) {
+		for (i=0;i<(int)n && p<end;i++) {
+			type = *p++;
+			if (loadgen_varint(&p, end, &seat) && client->seated && seat == client->seat
+					&& (type == event_die || type == event_leave)) {
+				client->direction = 0;
+				client->nturns = 0;
+			}
+		}
+	}
+	// runs of a skip, the values plus one and a zero
+	while (p < end && loadgen_varint(&p, end, &value)) {
+		while (loadgen_varint(&p, end, &value) && value) {
+			value--;
+			if (client->seated && (value & 7) == kind_head && value >> 6 == client->seat) {
+				loadgen_turned(loadgen, client, value >> 3 & 7, now);
+			}
+		}
+	}
+}
+
+// the text before the answer is skipped, every message counts as a frame
+void loadgen_parse_binary(loadgen_t *loadgen, loadgen_client_t *client, char *bytes, int nbytes, uint64_t now)
+{
+	int i, n;
+	unsigned char c;
+
+	for (i=0;i<nbytes;i+=n) {
+		n = 1;
+		c = bytes[i];
+		if (!client->acked) {
+			client->acked = c == LOADGEN_BINARY;
+			continue;
+		}
+		if (client->remaining) {
+			n = nbytes - i < (int)client->remaining ? nbytes - i : (int)client->remaining;
+			memcpy(client->message + client->received, bytes + i, n);
+			client->received += n;
+			client->nbytes += n;
+			client->remaining -= n;
+		} else {
+			client->nbytes++;
+			client->length |= (uint32_t)(c & 0x7f) << client->shift;
+			client->shift += 7;
+			if (c & 0x80) {
+				continue;
+			}
+			client->remaining = client->length;
+			if (client->length > client->message_size) {
+				client->message_size = client->length;
+				client->message = realloc(client->message, client->message_size);
+			}
+			client->received = 0;
+			client->length = 0;
+			client->shift = 0;
+		}
+		if (!client->remaining) {
+			loadgen_message(loadgen, client, now);
+			loadgen_frame(loadgen, client, now);
+		}
+	}
+}
+
+void loadgen_read(loadgen_t *loadgen, loadgen_client_t *client)
+{
+	int nbytes;
+	char bytes[65536];
+
+	nbytes = read(client->fd, bytes, sizeof(bytes));
+	if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return;
+	}
+	if (nbytes <= 0) {
+		loadgen_close(loadgen, client);
+		return;
+	}
+	if (loadgen->binary) {
+		loadgen_parse_binary(loadgen, client, bytes, nbytes, loadgen_clock());
+	} else {
+		loadgen_parse(loadgen, client, bytes, nbytes, loadgen_clock());
+	}
+}
+
+void loadgen_connected(loadgen_t *loadgen, loadgen_client_t *client)
+{
+	int error;
+	char byte = (char)LOADGEN_BINARY;
+	socklen_t len;
+	struct epoll_event event;
+
+	len = sizeof(error);
+	if (getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error) {
+		loadgen_close(loadgen, client);
+		return;
+	}
+	client->connected = true;
+	if (loadgen->binary) {
+		send(client->fd, &byte, 1, MSG_NOSIGNAL);
+	}
+	event.events = EPOLLIN;
+	event.data.ptr = client;
+	epoll_ctl(loadgen->epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+}
+
+// the direction a key turns to, as a binary client sends it
+char loadgen_opcode(char key)
+{
+	switch (key) {
+		case 's': return 1;
+		case 'w': return 2;
+		case 'd': return 3;
+		case 'a': return 4;
+	}
+	return key;
+}
+
+// the server drops a turn to where the snake already goes or back, the
+// others are timed until the head of the bot goes that way
+void loadgen_turn(loadgen_client_t *client, int direction, uint64_t now)
+{
+	int last;
+
+	last = client->nturns ? client->turns[client->nturns-1] : client->direction;
+	if (!last || client->nturns == LOADGEN_TURNS || direction == last || direction == loadgen_opposite(last)) {
+		return;
+	}
+	client->turns[client->nturns] = direction;
+	client->turn_times[client->nturns] = now;
+	client->nturns++;
+}
+
+// keys are sent at a steady rate, from the script or at random
+void loadgen_keys(loadgen_t *loadgen, uint64_t now)
+{
+	int i;
+	char key;
+	uint64_t period;
+	loadgen_client_t *client;
+
+	period = 1000000000ULL / loadgen->rate;
+	for (i=0;i<loadgen->nclients;i++) {
+		client = &loadgen->clients[i];
+		if (!client->connected || now < client->next_key) {
+			continue;
+		}
+		if (loadgen->script) {
+			key = loadgen->script[client->key++ % strlen(loadgen->script)];
+		} else {
+			key = "wasd"[rand() % 4];
+		}
+		if (loadgen->binary) {
+			key = loadgen_opcode(key);
+		}
+		if (send(client->fd, &key, 1, MSG_NOSIGNAL) == 1) {
+			loadgen->keys++;
+			if (loadgen->binary) {
+				loadgen_turn(client, key, now);
+			} else {
+				client->turn_times[client->nsent++ % LOADGEN_TURNS] = now;
+			}
+		}
+		client->next_key += period;
+		if (client->next_key <= now) {
+			client->next_key = now + period;
+		}
+	}
+}
+
+bool loadgen_start(loadgen_t *loadgen)
+{
+	int i;
+	uint64_t now;
+	struct rlimit limit;
+	struct epoll_event event;
+	loadgen_client_t *client;
+
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)loadgen->nclients + 16) {
+		limit.rlim_cur = (rlim_t)loadgen->nclients + 16;
+		if (limit.rlim_cur > limit.rlim_max) {
+			limit.rlim_cur = limit.rlim_max;
+		}
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	loadgen->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loadgen->epoll_fd < 0) {
+		fprintf(stderr, "Could not create epoll instance\n");
+		return false;
+	}
+	loadgen->clients = malloc(loadgen->nclients * sizeof(*loadgen->clients));
+	memset(loadgen->clients,0,loadgen->nclients * sizeof(*loadgen->clients));
+	now = loadgen_clock();
+	for (i=0;i<loadgen->nclients;i++) {
+		client = &loadgen->clients[i];
+		// spread the keystrokes of all bots over the period
+		if (loadgen->rate) {
+			client->next_key = now + (uint64_t)rand() % (1000000000ULL / loadgen->rate);
+		}
+		client->fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+		if (client->fd < 0) {
+			loadgen->failed++;
+			continue;
+		}
+		if (connect(client->fd, (struct sockaddr *)&loadgen->address, sizeof(loadgen->address)) < 0 && errno != EINPROGRESS) {
+			loadgen_close(loadgen, client);
+			continue;
+		}
+		event.events = EPOLLIN|EPOLLOUT;
+		event.data.ptr = client;
+		epoll_ctl(loadgen->epoll_fd, EPOLL_CTL_ADD, client->fd, &event);
+	}
+	return true;
+}
+
+void loadgen_run(loadgen_t *loadgen)
+{
+	int i, ready, msec;
+	uint64_t now, end;
+	struct epoll_event events[256];
+	loadgen_client_t *client;
+
+	end = loadgen_clock() + loadgen->seconds * 1000000000ULL;
+	while ((now = loadgen_clock()) < end) {
+		msec = (end - now) / 1000000 + 1;
+		if (loadgen->rate && msec > 1) {
+			msec = 1;
+		}
+		ready = epoll_wait(loadgen->epoll_fd, events, 256, msec);
+		for (i=0;i<ready;i++) {
+			client = (loadgen_client_t *)events[i].data.ptr;
+			if (client->fd < 0) {
+				continue;
+			}
+			if (!client->connected) {
+				loadgen_connected(loadgen, client);
+				continue;
+			}
+			loadgen_read(loadgen, client);
+		}
+		if (loadgen->rate) {
+			loadgen_keys(loadgen, loadgen_clock());
+		}
+	}
+}
+
+bool loadgen_resolve(struct sockaddr_in *address, char *host, int port)
+{
+	struct addrinfo hints, *result;
+
+	memset(&hints,0,sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, NULL, &hints, &result) != 0) {
+		return false;
+	}
+	*address = *(struct sockaddr_in *)result->ai_addr;
+	address->sin_port = htons(port);
+	freeaddrinfo(result);
+	return true;
+}
+
+int main(int argc, char ** argv)
+{
+	int i, connected;
+	loadgen_t loadgen;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s [port] [clients] [seconds] [keys per second] [script|random] [host] [text|binary]\n",argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	int port = atoi(argv[1]);
+
+	if (!port) {
+		fprintf(stderr, "Invalid port number\n");
+		return EXIT_FAILURE;
+	}
+
+	memset(&loadgen,0,sizeof(loadgen));
+	loadgen.nclients = argc > 2 ? atoi(argv[2]) : 100;
+	loadgen.seconds = argc > 3 ? atoi(argv[3]) : 10;
+	loadgen.rate = argc > 4 ? atoi(argv[4]) : 5;
+	if (argc > 5 && strcmp(argv[5],"random") && *argv[5]) {
+		loadgen.script = argv[5];
+	}
+	if (!loadgen_resolve(&loadgen.address, argc > 6 ? argv[6] : "127.0.0.1", port)) {
+		fprintf(stderr, "Could not resolve host\n");
+		return EXIT_FAILURE;
+	}
+	loadgen.binary = argc > 7 && !strcmp(argv[7],"binary");
+	if (loadgen.nclients < 1 || loadgen.seconds < 1 || loadgen.rate < 0) {
+		fprintf(stderr, "Invalid number of clients, seconds or keys per second\n");
+		return EXIT_FAILURE;
+	}
+	srand(time(NULL));
+
+	if (!loadgen_start(&loadgen)) {
+		return EXIT_FAILURE;
+	}
+	loadgen_run(&loadgen);
+
+	connected = 0;
+	for (i=0;i<loadgen.nclients;i++) {
+		if (loadgen.clients[i].fd < 0) {
+			continue;
+		}
+		connected += loadgen.clients[i].connected;
+		// never got through the backlog
+		if (!loadgen.clients[i].connected) {
+			loadgen.failed++;
+		}
+		close(loadgen.clients[i].fd);
+	}
+	fprintf(stdout, "clients   %d connected %d failed %d disconnected %d\n",
+			loadgen.nclients, connected, loadgen.failed, loadgen.disconnected);
+	fprintf(stdout, "frames    %llu bytes %llu per frame avg %.1f max %d\n",
+			(unsigned long long)loadgen.frames, (unsigned long long)loadgen.bytes,
+			loadgen.frames ? (double)loadgen.bytes / loadgen.frames : 0.0, loadgen.max_frame);
+	fprintf(stdout, "keys      %d\n", loadgen.keys);
+	loadgen_report("interval", &loadgen.intervals);
+	loadgen_report("latency", &loadgen.latencies);
+
+	close(loadgen.epoll_fd);
+	for (i=0;i<loadgen.nclients;i++) {
+		free(loadgen.clients[i].message);
+	}
+	free(loadgen.clients);
+	free(loadgen.intervals.values);
+	free(loadgen.latencies.values);
+
+	// a regression gate only has to check the exit status
+	return loadgen.failed || loadgen.disconnected ? EXIT_FAILURE : EXIT_SUCCESS;
+}
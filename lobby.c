@@ -26,80 +26,447 @@ typedef struct lobby_t lobby_t;
 
 struct lobby_t {
 	daemon_t *daemon;
-	void (*start_game)(daemon_t *daemon);
+	const lobby_game_t *game;
+	int room_size;
+	// clients waiting for a room to fill up, in order of arrival
+	int nwaiting;
+	int *waiting;
+	// rooms are kept dense, a destroyed room is replaced by the last one,
+	// there can be more than slots / room_size as a room lives on while
+	// anyone is left in it
+	int nrooms;
+	int maxrooms;
+	lobby_room_t **rooms;
+	// room and seat of every client, NULL while waiting, the seat of a
+	// spectator is its place in the list it is on
+	lobby_room_t **client_room;
+	int *client_seat;
+	bool *client_watching;
+	// spectators that wait for the first room to watch
+	lobby_spectators_t idle;
 };
 
-lobby_t *lobby_create()
+lobby_t *lobby_create(daemon_t *daemon, const lobby_game_t *game, int room_size)
 {
 	lobby_t *lobby;
+	int slots = daemon->slots;
+
 	lobby = malloc(sizeof(*lobby));
 	memset(lobby,0,sizeof(*lobby));
+	lobby->daemon = daemon;
+	lobby->game = game;
+	lobby->room_size = room_size;
+	lobby->waiting = malloc(room_size * sizeof(*lobby->waiting));
+	lobby->maxrooms = slots / room_size + 1;
+	lobby->rooms = malloc(lobby->maxrooms * sizeof(*lobby->rooms));
+	lobby->client_room = malloc(slots * sizeof(*lobby->client_room));
+	memset(lobby->client_room,0,slots * sizeof(*lobby->client_room));
+	lobby->client_seat = malloc(slots * sizeof(*lobby->client_seat));
+	lobby->client_watching = calloc(slots, sizeof(*lobby->client_watching));
 	return lobby;
 }
 
 void lobby_destroy(lobby_t *lobby)
 {
+	free(lobby->idle.clients);
+	free(lobby->client_watching);
+	free(lobby->client_seat);
+	free(lobby->client_room);
+	free(lobby->rooms);
+	free(lobby->waiting);
 	free(lobby);
 }
 
+void lobby_room_add(lobby_t *lobby, lobby_room_t *room)
+{
+	if (lobby->nrooms == lobby->maxrooms) {
+		lobby->maxrooms *= 2;
+		lobby->rooms = realloc(lobby->rooms, lobby->maxrooms * sizeof(*lobby->rooms));
+	}
+	room->index = lobby->nrooms;
+	lobby->rooms[lobby->nrooms++] = room;
+}
+
+lobby_room_t *lobby_room_create(lobby_t *lobby)
+{
+	lobby_room_t *room;
+	int seat, client;
+
+	room = malloc(sizeof(*room));
+	memset(room,0,sizeof(*room));
+	room->daemon = lobby->daemon;
+	room->size = lobby->room_size;
+	room->clients = malloc(room->size * sizeof(*room->clients));
+	for (seat=0;seat<room->size;seat++) {
+		client = lobby->waiting[seat];
+		room->clients[seat] = client;
+		lobby->client_room[client] = room;
+		lobby->client_seat[client] = seat;
+	}
+	room->nclients = room->size;
+	lobby->nwaiting = 0;
+	lobby_room_add(lobby, room);
+	room->context = lobby->game->create(room);
+	return room;
+}
+
+lobby_spectators_t *lobby_spectators(lobby_t *lobby, lobby_room_t *room)
+{
+	return room ? &room->spectators : &lobby->idle;
+}
+
+void lobby_unwatch(lobby_t *lobby, int client)
+{
+	int last;
+	lobby_spectators_t *spectators = lobby_spectators(lobby, lobby->client_room[client]);
+
+	last = spectators->clients[--spectators->nclients];
+	spectators->clients[lobby->client_seat[client]] = last;
+	lobby->client_seat[last] = lobby->client_seat[client];
+	lobby->client_room[client] = NULL;
+	lobby->client_watching[client] = false;
+}
+
+// a spectator costs the game one more client to send its frames to, a room
+// of NULL keeps it until a room starts
+void lobby_watch(lobby_t *lobby, int client, lobby_room_t *room)
+{
+	lobby_spectators_t *spectators = lobby_spectators(lobby, room);
+
+	if (lobby->client_watching[client]) {
+		lobby_unwatch(lobby, client);
+	}
+	if (spectators->nclients == spectators->size) {
+		spectators->size = spectators->size ? spectators->size * 2 : 16;
+		spectators->clients = realloc(spectators->clients, spectators->size * sizeof(*spectators->clients));
+	}
+	lobby->client_room[client] = room;
+	lobby->client_seat[client] = spectators->nclients;
+	lobby->client_watching[client] = true;
+	spectators->clients[spectators->nclients++] = client;
+	if (room) {
+		lobby->game->on_watch(room, client);
+	}
+}
+
+// the spectators go on to another room, or wait for the next one
+void lobby_room_destroy(lobby_t *lobby, lobby_room_t *room)
+{
+	lobby->game->destroy(room->context);
+	lobby->rooms[room->index] = lobby->rooms[--lobby->nrooms];
+	lobby->rooms[room->index]->index = room->index;
+	while (room->spectators.nclients) {
+		lobby_watch(lobby, room->spectators.clients[0], lobby->nrooms ? lobby->rooms[0] : NULL);
+	}
+	free(room->spectators.clients);
+	free(room->clients);
+	free(room);
+}
+
 void lobby_on_tick(daemon_t *daemon, int tick)
 {
-	fprintf(stdout,".");
-	fflush(stdout);
+	int i;
+	lobby_room_t *room;
+	lobby_t *lobby = (lobby_t *)daemon->context;
+
+	// rooms are only destroyed here, never from inside a game callback
+	for (i=lobby->nrooms-1;i>=0;i--) {
+		room = lobby->rooms[i];
+		if (room->nclients) {
+			lobby->game->on_tick(room, tick);
+		} else {
+			lobby_room_destroy(lobby, room);
+		}
+	}
+}
+
+void lobby_unwait(lobby_t *lobby, int client)
+{
+	int i;
+
+	// the waiting list never holds more than a room, so this scan is short
+	for (i=0;i<lobby->nwaiting;i++) {
+		if (lobby->waiting[i] == client) {
+			memmove(&lobby->waiting[i], &lobby->waiting[i+1], (lobby->nwaiting-i-1) * sizeof(*lobby->waiting));
+			lobby->nwaiting--;
+			break;
+		}
+	}
+}
+
+bool lobby_binary(daemon_t *daemon, int client)
+{
+	char byte = (char)LOBBY_BINARY;
+
+	if (daemon->client_binary[client]) {
+		return false;
+	}
+	daemon->client_binary[client] = true;
+	daemon_write(daemon, client, &byte, 1);
+	return true;
+}
+
+// a spectator can only leave, go on to the next room or switch to binary
+void lobby_on_watch_data(lobby_t *lobby, int client)
+{
+	int i, nbytes;
+	char bytes[DAEMON_INPUT];
+	lobby_room_t *room;
+
+	nbytes = daemon_read(lobby->daemon, client, bytes, sizeof(bytes));
+	for (i=0;i<nbytes;i++) {
+		switch ((unsigned char)bytes[i]) {
+			case 'q': daemon_disconnect(lobby->daemon, client); return;
+			case 'v':
+				room = lobby->client_room[client];
+				if (lobby->nrooms && (!room || lobby->nrooms > 1)) {
+					lobby_watch(lobby, client, lobby->rooms[room ? (room->index + 1) % lobby->nrooms : 0]);
+				}
+				break;
+			case LOBBY_BINARY:
+				room = lobby->client_room[client];
+				if (lobby_binary(lobby->daemon, client) && room) {
+					lobby->game->on_watch(room, client);
+				}
+				break;
+		}
+	}
 }
 
 void lobby_on_data(daemon_t *daemon, int client)
 {
 	int nbytes;
 	char bytes[1024];
+	lobby_t *lobby = (lobby_t *)daemon->context;
 
-	fprintf(stdout,"#%d",client);
-	fflush(stdout);
+	if (lobby->client_watching[client]) {
+		lobby_on_watch_data(lobby, client);
+		return;
+	}
+	if (lobby->client_room[client]) {
+		lobby->game->on_data(lobby->client_room[client], lobby->client_seat[client]);
+		return;
+	}
 
 	nbytes = daemon_read(daemon, client, bytes, sizeof(bytes));
-	if (nbytes) {
+	// the frames of the room it gets are binary from the start
+	if (nbytes > 0 && memchr(bytes, LOBBY_BINARY, nbytes)) {
+		lobby_binary(daemon, client);
+	}
+	// a waiting client that presses v watches instead of playing
+	if (nbytes > 0 && memchr(bytes, 'v', nbytes)) {
+		lobby_unwait(lobby, client);
+		lobby_watch(lobby, client, lobby->nrooms ? lobby->rooms[0] : NULL);
+		return;
+	}
+	if (nbytes > 0 && !daemon->client_binary[client]) {
 		daemon_write(daemon, client, bytes, nbytes);
 	}
 }
 
 void lobby_on_connect(daemon_t *daemon, int client)
 {
-	int nbytes;
+	int nbytes, seat;
 	char *bytes;
-
-	uint8_t *addr = (uint8_t *)&daemon->client_address[client].sin_addr.s_addr;
-	uint16_t *port = (uint16_t *)&daemon->client_address[client].sin_port;
-
-	fprintf(stdout,"#%d[%d.%d.%d.%d:%d]",client,addr[0],addr[1],addr[2],addr[3],*port);
-	fflush(stdout);
+	lobby_room_t *room;
+	lobby_t *lobby = (lobby_t *)daemon->context;
 
 	bytes = "Welcome\n";
 	nbytes = strlen(bytes);
 
 	daemon_write(daemon,client,bytes,nbytes);
 
+	lobby->client_room[client] = NULL;
+	lobby->client_watching[client] = false;
+	// a spectator never waits for a seat
+	if (daemon->client_spectator[client]) {
+		lobby_watch(lobby, client, lobby->nrooms ? lobby->rooms[0] : NULL);
+		return;
+	}
+	lobby->waiting[lobby->nwaiting++] = client;
+	if (lobby->nwaiting == lobby->room_size) {
+		room = lobby_room_create(lobby);
+		for (seat=0;seat<room->size;seat++) {
+			lobby->game->on_connect(room, seat);
+		}
+		while (lobby->idle.nclients) {
+			lobby_watch(lobby, lobby->idle.clients[0], room);
+		}
+	}
+}
+
+void lobby_on_disconnect(daemon_t *daemon, int client)
+{
+	lobby_room_t *room;
 	lobby_t *lobby = (lobby_t *)daemon->context;
 
-	lobby->start_game(daemon);
-	lobby_destroy(lobby);
+	if (lobby->client_watching[client]) {
+		lobby_unwatch(lobby, client);
+		return;
+	}
+	room = lobby->client_room[client];
+	if (room) {
+		lobby->client_room[client] = NULL;
+		room->clients[lobby->client_seat[client]] = -1;
+		room->nclients--;
+		lobby->game->on_disconnect(room, lobby->client_seat[client]);
+		return;
+	}
+	lobby_unwait(lobby, client);
 }
 
-void lobby_on_disconnect(daemon_t *daemon, int client)
+void lobby_on_resync(daemon_t *daemon, int client)
+{
+	lobby_t *lobby = (lobby_t *)daemon->context;
+
+	if (lobby->client_watching[client]) {
+		if (lobby->client_room[client]) {
+			lobby->game->on_watch(lobby->client_room[client], client);
+		}
+		return;
+	}
+	if (lobby->client_room[client]) {
+		lobby->game->on_resync(lobby->client_room[client], lobby->client_seat[client]);
+	}
+}
+
+void lobby_save_spectators(daemon_state_t *state, lobby_spectators_t *spectators)
+{
+	daemon_save(state, &spectators->nclients, sizeof(spectators->nclients));
+	daemon_save(state, spectators->clients, spectators->nclients * sizeof(*spectators->clients));
+}
+
+// the waiting list and the rooms, where everyone is follows from those
+void lobby_on_save(daemon_t *daemon, daemon_state_t *state)
+{
+	int i;
+	lobby_room_t *room;
+	lobby_t *lobby = (lobby_t *)daemon->context;
+
+	daemon_save(state, &lobby->room_size, sizeof(lobby->room_size));
+	daemon_save(state, &lobby->nwaiting, sizeof(lobby->nwaiting));
+	daemon_save(state, lobby->waiting, lobby->nwaiting * sizeof(*lobby->waiting));
+	lobby_save_spectators(state, &lobby->idle);
+	daemon_save(state, &lobby->nrooms, sizeof(lobby->nrooms));
+	for (i=0;i<lobby->nrooms;i++) {
+		room = lobby->rooms[i];
+		daemon_save(state, &room->nclients, sizeof(room->nclients));
+		daemon_save(state, room->clients, room->size * sizeof(*room->clients));
+		lobby_save_spectators(state, &room->spectators);
+		lobby->game->save(room, state);
+	}
+}
+
+// a client of the lobby has to be one the daemon has, -1 is an empty seat
+bool lobby_load_client(lobby_t *lobby, daemon_state_t *state, int *client, bool seat)
 {
-	fprintf(stdout,"[disconnect]");
-	fflush(stdout);
+	if (!daemon_load(state, client, sizeof(*client))) {
+		return false;
+	}
+	if (seat && *client == -1) {
+		return true;
+	}
+	return *client >= 0 && *client < lobby->daemon->slots && lobby->daemon->client_fd[*client] >= 0;
+}
+
+bool lobby_load_spectators(lobby_t *lobby, daemon_state_t *state, lobby_spectators_t *spectators, lobby_room_t *room)
+{
+	int i, n, client;
+
+	if (!daemon_load(state, &n, sizeof(n)) || n < 0 || n > lobby->daemon->slots) {
+		return false;
+	}
+	spectators->size = n > 16 ? n : 16;
+	spectators->clients = malloc(spectators->size * sizeof(*spectators->clients));
+	for (i=0;i<n;i++) {
+		if (!lobby_load_client(lobby, state, &client, false)) {
+			return false;
+		}
+		spectators->clients[spectators->nclients++] = client;
+		lobby->client_room[client] = room;
+		lobby->client_seat[client] = i;
+		lobby->client_watching[client] = true;
+	}
+	return true;
 }
 
-void lobby_run(daemon_t *daemon, void (*start_game)(daemon_t *daemon))
+bool lobby_load_room(lobby_t *lobby, daemon_state_t *state)
+{
+	int seat, client;
+	lobby_room_t *room;
+
+	room = malloc(sizeof(*room));
+	memset(room,0,sizeof(*room));
+	room->daemon = lobby->daemon;
+	room->size = lobby->room_size;
+	room->clients = malloc(room->size * sizeof(*room->clients));
+	lobby_room_add(lobby, room);
+	daemon_load(state, &room->nclients, sizeof(room->nclients));
+	for (seat=0;seat<room->size;seat++) {
+		room->clients[seat] = -1;
+	}
+	for (seat=0;seat<room->size;seat++) {
+		if (!lobby_load_client(lobby, state, &client, true)) {
+			return false;
+		}
+		room->clients[seat] = client;
+		if (client >= 0) {
+			lobby->client_room[client] = room;
+			lobby->client_seat[client] = seat;
+		}
+	}
+	if (!lobby_load_spectators(lobby, state, &room->spectators, room)) {
+		return false;
+	}
+	room->context = lobby->game->load(room, state);
+	return room->context != NULL;
+}
+
+// a room that could not be read is left half done, the new process does
+// not start then and the old one goes on
+bool lobby_on_load(daemon_t *daemon, daemon_state_t *state)
+{
+	int i, n, client;
+	lobby_t *lobby = (lobby_t *)daemon->context;
+
+	if (!daemon_load(state, &n, sizeof(n)) || n != lobby->room_size) {
+		fprintf(stderr, "Rooms of %d cannot take over rooms of %d\n", lobby->room_size, n);
+		return false;
+	}
+	if (!daemon_load(state, &n, sizeof(n)) || n < 0 || n >= lobby->room_size) {
+		return false;
+	}
+	for (i=0;i<n;i++) {
+		if (!lobby_load_client(lobby, state, &client, false)) {
+			return false;
+		}
+		lobby->waiting[lobby->nwaiting++] = client;
+	}
+	if (!lobby_load_spectators(lobby, state, &lobby->idle, NULL)) {
+		return false;
+	}
+	if (!daemon_load(state, &n, sizeof(n)) || n < 0) {
+		return false;
+	}
+	for (i=0;i<n;i++) {
+		if (!lobby_load_room(lobby, state)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void lobby_run(daemon_t *daemon, const lobby_game_t *game, int room_size)
 {
 	lobby_t *lobby;
-	lobby = lobby_create();
-	lobby->daemon = daemon;
-	lobby->start_game = start_game;
+	lobby = lobby_create(daemon, game, room_size);
 	daemon->context = (void *)lobby;
 
 	daemon->on_connect = lobby_on_connect;
 	daemon->on_disconnect = lobby_on_disconnect;
 	daemon->on_data = lobby_on_data;
 	daemon->on_tick = lobby_on_tick;
+	daemon->on_resync = lobby_on_resync;
+	daemon->on_save = lobby_on_save;
+	daemon->on_load = lobby_on_load;
 }
@@ -12,6 +12,53 @@
 
 #include "daemon.h"
 
-void lobby_run(daemon_t *daemon, void (*start_game)(daemon_t *daemon));
+// a client that sends this byte speaks the binary protocol of the game once
+// the byte comes back, which it finds by skipping the text before it since
+// neither the text frames nor UTF-8 have this byte
+#define LOBBY_BINARY 0xfe
+
+typedef struct lobby_game_t lobby_game_t;
+typedef struct lobby_room_t lobby_room_t;
+typedef struct lobby_spectators_t lobby_spectators_t;
+
+// clients that only watch, they hold no seat and their order changes
+struct lobby_spectators_t {
+	int *clients;
+	int nclients;
+	int size;
+};
+
+// a match between size players, seats are numbered from 0
+struct lobby_room_t {
+	daemon_t *daemon;
+	void *context;
+	int size;
+	int nclients;
+	int *clients;
+	int index;
+	lobby_spectators_t spectators;
+};
+
+// callbacks of a game that is played in rooms
+struct lobby_game_t {
+	void *(*create)(lobby_room_t *room);
+	void (*destroy)(void *context);
+	void (*on_connect)(lobby_room_t *room, int seat);
+	void (*on_disconnect)(lobby_room_t *room, int seat);
+	void (*on_data)(lobby_room_t *room, int seat);
+	void (*on_tick)(lobby_room_t *room, int tick);
+	void (*on_resync)(lobby_room_t *room, int seat);
+	// a spectator came in, or its backlog was dropped like on a resync
+	void (*on_watch)(lobby_room_t *room, int client);
+	// the room's state for the process that takes over, and the context
+	// made from it there, NULL when it cannot be read
+	void (*save)(lobby_room_t *room, daemon_state_t *state);
+	void *(*load)(lobby_room_t *room, daemon_state_t *state);
+};
+
+void lobby_run(daemon_t *daemon, const lobby_game_t *game, int room_size);
+
+// answers the request for binary, false when the client had it already
+bool lobby_binary(daemon_t *daemon, int client);
 
 #endif /* LOBBY_H_ */
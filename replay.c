@@ -0,0 +1,276 @@
+/*
+ ============================================================================
+ Name        : replay.c
+ Description : Replays a match log of snaked without clients
+ Author      : Maurits van der Schee <maurits@vdschee.nl>
+ URL         : https://github.com/mevdschee/daemon-games
+ ============================================================================
+ */
+#define SNAKE_NO_MAIN
+#include "snaked.c"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef struct replay_t replay_t;
+
+struct replay_t {
+	const unsigned char *data;
+	size_t size;
+	size_t offset;
+	snake_t *snake;
+	// seats that joined and did not leave, these get a view drawn
+	bool *seated;
+	bool render;
+	// what a binary client would have been sent instead of a terminal
+	bool binary;
+	uint64_t ticks;
+	uint64_t inputs;
+	uint64_t checks;
+	uint64_t bytes;
+};
+
+uint64_t replay_clock()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+bool replay_u32(replay_t *replay, uint32_t *value)
+{
+	int i;
+
+	if (replay->offset + 4 > replay->size) {
+		return false;
+	}
+	*value = 0;
+	for (i=0;i<4;i++) {
+		*value |= (uint32_t)replay->data[replay->offset++] << (i*8);
+	}
+	return true;
+}
+
+bool replay_varint(replay_t *replay, unsigned int *value)
+{
+	int shift;
+	unsigned char byte;
+
+	*value = 0;
+	for (shift=0;shift<32;shift+=7) {
+		if (replay->offset == replay->size) {
+			return false;
+		}
+		byte = replay->data[replay->offset++];
+		*value |= (unsigned int)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// the seat of a record has to be one of the room
+bool replay_seat(replay_t *replay, int *seat)
+{
+	unsigned int value;
+
+	if (!replay_varint(replay, &value) || value >= (unsigned int)replay->snake->nplayers) {
+		return false;
+	}
+	*seat = value;
+	return true;
+}
+
+bool replay_open(replay_t *replay, const char *filename)
+{
+	int fd;
+	struct stat st;
+	uint32_t version, width, height, players, seed;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror("Could not open log");
+		if (fd >= 0) {
+			close(fd);
+		}
+		return false;
+	}
+	replay->size = st.st_size;
+	replay->data = replay->size ? mmap(NULL, replay->size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (replay->data == MAP_FAILED) {
+		fprintf(stderr, "Could not map log %s\n", filename);
+		return false;
+	}
+	replay->offset = sizeof(SNAKE_LOG_MAGIC) - 1;
+	if (replay->size < replay->offset || memcmp(replay->data, SNAKE_LOG_MAGIC, replay->offset)
+			|| !replay_u32(replay, &version) || version != SNAKE_LOG_VERSION
+			|| !replay_u32(replay, &width) || !replay_u32(replay, &height)
+			|| !replay_u32(replay, &players) || !replay_u32(replay, &seed)
+			|| width < 1 || height < 1 || players < 1 || players > SNAKE_MAX_PLAYERS) {
+		fprintf(stderr, "Not a match log of this version: %s\n", filename);
+		munmap((void *)replay->data, replay->size);
+		return false;
+	}
+	replay->snake = snake_create(width, height, players);
+	replay->snake->seed = seed;
+	replay->seated = calloc(players, sizeof(*replay->seated));
+	return true;
+}
+
+void replay_close(replay_t *replay)
+{
+	munmap((void *)replay->data, replay->size);
+	free(replay->seated);
+	snake_destroy(replay->snake);
+}
+
+void replay_render_view(replay_t *replay, int seat, int dx, int dy, bool full)
+{
+	snake_t *snake = replay->snake;
+
+	strbuf_reset(snake->sb);
+	if (replay->binary) {
+		snake_get_wire_view(snake, snake->sb, seat, dx, dy, full);
+	} else {
+		snake_get_view(snake, snake->sb, seat, dx, dy, full);
+	}
+	replay->bytes += snake->sb->length;
+}
+
+// draws what the clients of the room would have been sent for this tick
+void replay_render(replay_t *replay, int seat, bool full)
+{
+	int dx, dy;
+	snake_t *snake = replay->snake;
+
+	strbuf_reset(snake->sb);
+	if (!snake_scrolling(snake)) {
+		if (replay->binary) {
+			snake_get_wire_frame(snake, snake->sb, full);
+		} else {
+			snake_get_frame(snake, snake->sb, full);
+		}
+		replay->bytes += snake->sb->length;
+		return;
+	}
+	if (seat >= 0) {
+		replay_render_view(replay, seat, 0, 0, full);
+		return;
+	}
+	snake_collect(snake);
+	snake_index(snake);
+	for (seat=0;seat<snake->nplayers;seat++) {
+		if (replay->seated[seat]) {
+			snake_follow(snake, seat, &dx, &dy);
+			replay_render_view(replay, seat, dx, dy, false);
+		}
+	}
+}
+
+// runs every record in order, a record that breaks out of the switch was
+// cut short, false also when the match went another way than on the server
+bool replay_run(replay_t *replay)
+{
+	int op, seat;
+	uint32_t hash;
+	snake_t *snake = replay->snake;
+
+	while (replay->offset < replay->size) {
+		op = replay->data[replay->offset++];
+		switch (op & 0x0f) {
+			case log_tick:
+			case log_food:
+				snake_step(snake, (op & 0x0f) == log_food);
+				snake->frame++;
+				replay->ticks++;
+				if (replay->render) {
+					replay_render(replay, -1, false);
+				}
+				snake_clear_events(snake);
+				snake_commit(snake);
+				continue;
+			case log_join:
+				if (!replay_seat(replay, &seat)) {
+					break;
+				}
+				snake_join(snake, seat);
+				replay->seated[seat] = true;
+				if (replay->render) {
+					snake_center(snake, seat);
+					replay_render(replay, seat, true);
+				}
+				continue;
+			case log_leave:
+				if (!replay_seat(replay, &seat)) {
+					break;
+				}
+				snake_leave(snake, seat);
+				replay->seated[seat] = false;
+				continue;
+			case log_turn:
+				if (!replay_seat(replay, &seat)) {
+					break;
+				}
+				snake_queue_turn(snake, seat, op >> 4);
+				replay->inputs++;
+				continue;
+			case log_check:
+				if (!replay_u32(replay, &hash)) {
+					break;
+				}
+				if (hash != snake_checksum(snake)) {
+					fprintf(stderr, "Replay differs from the match at tick %llu\n", (unsigned long long)replay->ticks);
+					return false;
+				}
+				replay->checks++;
+				continue;
+			default:
+				fprintf(stderr, "Unknown record %d at byte %zu\n", op, replay->offset - 1);
+				return false;
+		}
+		fprintf(stderr, "Log ends inside a record at byte %zu\n", replay->offset);
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char ** argv)
+{
+	int i, alive;
+	bool ok;
+	uint64_t start, elapsed;
+	replay_t replay;
+
+	if (argc < 2 || argc > 3 || (argc == 3 && strcmp(argv[2], "render") && strcmp(argv[2], "binary"))) {
+		fprintf(stderr, "Usage: %s [log] [render|binary]\n",argv[0]);
+		return EXIT_FAILURE;
+	}
+	memset(&replay, 0, sizeof(replay));
+	replay.render = argc == 3;
+	replay.binary = argc == 3 && !strcmp(argv[2], "binary");
+	if (!replay_open(&replay, argv[1])) {
+		return EXIT_FAILURE;
+	}
+
+	start = replay_clock();
+	ok = replay_run(&replay);
+	elapsed = replay_clock() - start;
+
+	alive = 0;
+	for (i=0;i<replay.snake->nplayers;i++) {
+		alive += replay.snake->players[i].alive;
+	}
+	fprintf(stdout, "world\t%dx%d, %d seats, %d alive\n", replay.snake->width, replay.snake->height, replay.snake->nplayers, alive);
+	fprintf(stdout, "ticks\t%llu, %llu turns, %llu checks passed\n", (unsigned long long)replay.ticks, (unsigned long long)replay.inputs, (unsigned long long)replay.checks);
+	fprintf(stdout, "time\t%.3f s, %.1f ns/tick, %.0f ticks/s\n", elapsed / 1e9,
+			replay.ticks ? (double)elapsed / replay.ticks : 0.0, elapsed ? replay.ticks * 1e9 / elapsed : 0.0);
+	if (replay.render) {
+		fprintf(stdout, "render\t%llu bytes, %.1f bytes/tick\n", (unsigned long long)replay.bytes,
+				replay.ticks ? (double)replay.bytes / replay.ticks : 0.0);
+	}
+	replay_close(&replay);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
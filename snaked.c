@@ -10,15 +10,87 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "daemon.h"
+#include "diff.h"
 #include "lobby.h"
 #include "strbuf.h"
+#include "term.h"
+#include "wire.h"
 
 typedef struct snake_t snake_t;
 
 enum directions { none, down, up, right, left };
 
+enum snake_kinds { kind_empty, kind_food, kind_head, kind_body, kind_tail };
+
+// a cell packs its direction, what is on it and the player that owns it in
+// the upper half, the touched bit is set while the cell is listed as written
+// this frame
+typedef uint32_t snake_cell_t;
+
+#define SNAKE_DIRECTION_MASK 0x0007
+#define SNAKE_KIND_SHIFT 3
+#define SNAKE_KIND_MASK 0x0038
+#define SNAKE_TOUCHED 0x0080
+#define SNAKE_OWNER_SHIFT 16
+
+// turns a player can key in ahead, the rest of a burst is dropped
+#define SNAKE_TURNS 4
+
+// bytes of frame buffer a room keeps after rendering a large full frame
+#define SNAKE_FRAME_KEEP 65536
+
+// frames a lagging client can be behind and still catch up with a delta
+#define SNAKE_HISTORY 32
+
+// a larger world is seen through a view of this many cells that scrolls
+#define SNAKE_VIEW_WIDTH 40
+#define SNAKE_VIEW_HEIGHT 20
+
+// the changed cells are indexed by squares of this size
+#define SNAKE_CHUNK 16
+
+// cells per food every hundred ticks, a 40x20 board gets one
+#define SNAKE_FOOD_AREA 800
+
+// the owner of a cell has sixteen bits
+#define SNAKE_MAX_PLAYERS 65536
+
+// bytes of match log a room collects before it hands them to the writer
+#define SNAKE_LOG_FLUSH 65536
+
+// buffers of all rooms the writer may be behind, a room whose log does not
+// fit gives it up rather than wait for the disk
+#define SNAKE_LOG_QUEUE 64
+
+// the log starts with the magic, then the version, width, height, seats and
+// seed as 32 bit little endian words
+#define SNAKE_LOG_MAGIC "SNAKELOG"
+#define SNAKE_LOG_VERSION 1
+
+// a room is handed to a new process in this layout, one that has another
+// refuses the handoff and the old process keeps running
+#define SNAKE_STATE_VERSION 1
+
+// a log record is one byte, the op in the low nibble and the direction of a
+// turn in the high one, followed by the seat of a join, leave or turn as a
+// varint, or the 32 bit state hash of a check
+enum snake_log_ops { log_tick, log_food, log_join, log_leave, log_turn, log_check };
+
+// binary messages, a keyframe has the world and view size, the top left of
+// the view and the cells that are not empty, a delta the scroll as zigzag
+// varints, the events since the last frame and the cells that changed or
+// came into view, where cells that come into view start out empty
+enum snake_messages { message_keyframe = 1, message_delta, message_seat };
+
+// an event is a byte followed by the seat as a varint
+enum snake_events { event_join, event_leave, event_eat, event_die };
+
 struct snake_position_t {
 	int x,y;
 };
@@ -28,6 +100,51 @@ struct snake_player_t {
 	int length;
 	char direction;
 	struct snake_position_t head, tail, previous_head, previous_tail;
+	char turns[SNAKE_TURNS];
+	int nturns;
+	// the outcome of the move of this tick, decided before any cell changes
+	bool eats;
+	bool crashes;
+};
+
+// top left cell of the part of the world a client has on screen
+struct snake_view_t {
+	int x,y;
+};
+
+// a cell written in this frame and what it held in the last one
+struct snake_change_t {
+	int cell;
+	snake_cell_t old;
+};
+
+// a cell some heads move to this tick, -1 while the slot is free
+struct snake_target_t {
+	int cell;
+	int heads;
+};
+
+// a match log as the room and the writer share it
+struct snake_log_file_t {
+	int fd;
+	// set by the writer, the room gives the log up when it sees it
+	bool failed;
+	// buffers of this log that are not written yet
+	int pending;
+};
+
+// NULL records close the file, after what came before it is written
+struct snake_log_write_t {
+	struct snake_log_file_t *file;
+	strbuf_t *records;
+	struct snake_log_write_t *next;
+};
+
+// the cells that changed in a frame
+struct snake_history_t {
+	int *cells;
+	int ncells;
+	int size;
 };
 
 struct snake_t {
@@ -35,48 +152,150 @@ struct snake_t {
 	struct snake_player_t *players;
 	int width;
 	int height;
-	char *fields;
-	char *previous_fields;
-	char *directions;
+	snake_cell_t *cells;
+	// an empty board that is never written, so it costs no memory, a
+	// keyframe is the diff against it
+	snake_cell_t *blank;
+	diff_t *diff;
+	// cells written since the last frame, only these can differ from it
+	struct snake_change_t *dirty;
+	int ndirty;
+	int dirty_size;
+	// reused by every render of the room, it grows to the largest frame
+	strbuf_t *sb;
+	// id of the frame on the board, a client that saw none has 0
+	uint64_t frame;
+	struct snake_history_t history[SNAKE_HISTORY];
+	// full frame of the board in text and binary, rendered once for everyone
+	// who needs it
+	daemon_frame_t *keyframes[2];
+	// every seat sees its own part of a world larger than the view, the
+	// spectators share one more view that follows the seat they watch
+	int view_width;
+	int view_height;
+	struct snake_view_t *views;
+	int watched;
+	// changed cells as chunk << 32 | cell in order, to find those in a view
+	uint64_t *index;
+	int nindex;
+	int index_size;
+	int chunks;
+	// changed cells in the view being drawn, as position << 32 | cell
+	uint64_t *spots;
+	int nspots;
+	int spots_size;
+	// open addressed by cell, twice the seats rounded up to a power of two
+	struct snake_target_t *targets;
+	int targets_mask;
+	// food falls where this seed says, so a replay places it the same way
+	unsigned int seed;
+	// what a room with a log has done since the last write, NULL without
+	strbuf_t *log;
+	struct snake_log_file_t *log_file;
+	// what happened to the players since the last frame, encoded once for
+	// the binary clients
+	strbuf_t *events;
+	int nevents;
 };
 
-char snake_get(char *field, int w, int h, int x, int y)
+static inline snake_cell_t snake_cell(int kind, int owner, char direction)
 {
-	if (x < 0 || y < 0 || x >= w || y >= h) {
-		fprintf(stderr, "Read from field out of bounds\n");
+	return (uint32_t)owner << SNAKE_OWNER_SHIFT | kind << SNAKE_KIND_SHIFT | direction;
+}
+
+static inline int snake_kind(snake_cell_t cell)
+{
+	return (cell & SNAKE_KIND_MASK) >> SNAKE_KIND_SHIFT;
+}
+
+static inline int snake_owner(snake_cell_t cell)
+{
+	return cell >> SNAKE_OWNER_SHIFT;
+}
+
+static inline char snake_direction(snake_cell_t cell)
+{
+	return cell & SNAKE_DIRECTION_MASK;
+}
+
+// positions always come from the wrapping moves, build with -DSNAKE_DEBUG
+// to check that anyway
+static inline int snake_offset(snake_t *snake, struct snake_position_t *pos)
+{
+#ifdef SNAKE_DEBUG
+	if (pos->x < 0 || pos->y < 0 || pos->x >= snake->width || pos->y >= snake->height) {
+		fprintf(stderr, "Cell %d,%d out of bounds\n", pos->x, pos->y);
 		exit(EXIT_FAILURE);
 	}
+#endif
+	return pos->y * snake->width + pos->x;
+}
 
-	return *(field + (y * w + x) * sizeof(*field));
+void snake_grow_dirty(snake_t *snake)
+{
+	snake->dirty_size = snake->dirty_size ? snake->dirty_size*2 : 64;
+	snake->dirty = realloc(snake->dirty,snake->dirty_size*sizeof(*snake->dirty));
 }
 
-void snake_set(char *field, int w, int h, int x, int y, char c)
+// the first write of a frame lists the cell with what it held before
+static inline void snake_write(snake_t *snake, int cell, snake_cell_t value)
 {
-	if (x < 0 || y < 0 || x >= w || y >= h) {
-		fprintf(stderr, "Write to field out of bounds\n");
-		exit(EXIT_FAILURE);
+	snake_cell_t old = snake->cells[cell];
+
+	if (!(old & SNAKE_TOUCHED)) {
+		if (snake->ndirty == snake->dirty_size) {
+			snake_grow_dirty(snake);
+		}
+		snake->dirty[snake->ndirty].cell = cell;
+		snake->dirty[snake->ndirty].old = old;
+		snake->ndirty++;
 	}
-	*(field + (y * w + x) * sizeof(*field)) = c;
+	snake->cells[cell] = value | SNAKE_TOUCHED;
+}
+
+static inline snake_cell_t snake_read(snake_t *snake, int cell)
+{
+	return snake->cells[cell] & ~SNAKE_TOUCHED;
 }
 
-char snake_get_field(snake_t *snake, struct snake_position_t *pos)
+// what is drawn for a cell, only a head shows its direction
+static inline snake_cell_t snake_look(snake_cell_t cell)
 {
-	return snake_get(snake->fields,snake->width,snake->height,pos->x,pos->y);
+	return snake_kind(cell) == kind_head ? cell : cell & ~SNAKE_DIRECTION_MASK;
 }
 
-char snake_get_direction(snake_t *snake, struct snake_position_t *pos)
+// what a binary client gets for a cell, empty is 0 and food 1, a snake part
+// has its owner above the direction of a head and the kind
+static inline unsigned int snake_wire_value(snake_cell_t cell)
 {
-	return snake_get(snake->directions,snake->width,snake->height,pos->x,pos->y);
+	cell = snake_look(cell);
+	return (unsigned int)snake_owner(cell) << 6 | snake_direction(cell) << 3 | snake_kind(cell);
 }
 
-void snake_set_field(snake_t *snake, struct snake_position_t *pos, char c)
+static inline int snake_get_kind(snake_t *snake, struct snake_position_t *pos)
 {
-	snake_set(snake->fields,snake->width,snake->height,pos->x,pos->y,c);
+	return snake_kind(snake_read(snake,snake_offset(snake,pos)));
 }
 
-void snake_set_direction(snake_t *snake, struct snake_position_t *pos, char c)
+static inline char snake_get_direction(snake_t *snake, struct snake_position_t *pos)
 {
-	snake_set(snake->directions,snake->width,snake->height,pos->x,pos->y,c);
+	return snake_direction(snake_read(snake,snake_offset(snake,pos)));
+}
+
+// the direction stays
+static inline void snake_set_kind(snake_t *snake, struct snake_position_t *pos, int kind, int owner)
+{
+	int cell = snake_offset(snake,pos);
+
+	snake_write(snake,cell,snake_cell(kind,owner,snake_direction(snake_read(snake,cell))));
+}
+
+// what is on the cell stays
+static inline void snake_set_direction(snake_t *snake, struct snake_position_t *pos, char direction)
+{
+	int cell = snake_offset(snake,pos);
+
+	snake_write(snake,cell,(snake_read(snake,cell) & ~SNAKE_DIRECTION_MASK) | direction);
 }
 
 snake_t *snake_create(int width, int height, int slots)
@@ -84,49 +303,420 @@ snake_t *snake_create(int width, int height, int slots)
 	snake_t *snake = malloc(sizeof(*snake));
 	snake->nplayers = slots;
 	snake->players = malloc(snake->nplayers*sizeof(*snake->players));
+	memset(snake->players,0,snake->nplayers*sizeof(*snake->players));
 	snake->width = width;
 	snake->height = height;
-	size_t field_size = width*height*sizeof(*snake->fields);
-	snake->fields = malloc(field_size);
-	memset(snake->fields,0,field_size);
-	snake->previous_fields = malloc(field_size);
-	memset(snake->previous_fields,0,field_size);
-	snake->directions = malloc(field_size);
-	memset(snake->directions,none,field_size);
+	// zeroed pages are only backed by memory once a snake or food gets there
+	snake->cells = calloc((size_t)width*height,sizeof(*snake->cells));
+	snake->blank = calloc((size_t)width*height,sizeof(*snake->blank));
+	snake->diff = diff_create();
+	snake->dirty = NULL;
+	snake->ndirty = 0;
+	snake->dirty_size = 0;
+	snake->sb = strbuf_create();
+	snake->frame = 1;
+	memset(snake->history,0,sizeof(snake->history));
+	snake->keyframes[0] = snake->keyframes[1] = NULL;
+	snake->view_width = width < SNAKE_VIEW_WIDTH ? width : SNAKE_VIEW_WIDTH;
+	snake->view_height = height < SNAKE_VIEW_HEIGHT ? height : SNAKE_VIEW_HEIGHT;
+	snake->views = calloc(slots+1,sizeof(*snake->views));
+	snake->watched = 0;
+	snake->index = NULL;
+	snake->nindex = 0;
+	snake->index_size = 0;
+	snake->chunks = (width+SNAKE_CHUNK-1)/SNAKE_CHUNK;
+	snake->spots = NULL;
+	snake->nspots = 0;
+	snake->spots_size = 0;
+	snake->targets_mask = 1;
+	while (snake->targets_mask < 2*slots) {
+		snake->targets_mask *= 2;
+	}
+	snake->targets = malloc(snake->targets_mask*sizeof(*snake->targets));
+	snake->targets_mask--;
+	snake->seed = 1;
+	snake->log = NULL;
+	snake->log_file = NULL;
+	snake->events = strbuf_create();
+	snake->nevents = 0;
 	return snake;
 }
 
+void snake_log_u32(strbuf_t *log, uint32_t value)
+{
+	int i;
+
+	for (i=0;i<4;i++) {
+		strbuf_append_char(log, (char)(value >> (i*8)));
+	}
+}
+
+void snake_log_varint(strbuf_t *log, unsigned int value)
+{
+	while (value >= 0x80) {
+		strbuf_append_char(log, (char)(value | 0x80));
+		value >>= 7;
+	}
+	strbuf_append_char(log, (char)value);
+}
+
+static inline void snake_log_op(snake_t *snake, int op, int seat)
+{
+	if (!snake->log) {
+		return;
+	}
+	strbuf_append_char(snake->log, (char)op);
+	if (seat >= 0) {
+		snake_log_varint(snake->log, seat);
+	}
+}
+
+// one thread writes the logs of all rooms in the order they were handed
+// over, so a slow disk holds up no tick
+struct snake_writer_t {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	// a write is done, for a room that waits until its log is on disk
+	pthread_cond_t done;
+	struct snake_log_write_t *first;
+	struct snake_log_write_t *last;
+	int nbuffers;
+	unsigned int dropped;
+	bool stopping;
+	pthread_t thread;
+};
+
+struct snake_writer_t snake_writer = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+pthread_once_t snake_writer_once = PTHREAD_ONCE_INIT;
+
+bool snake_log_write(struct snake_log_file_t *file, strbuf_t *records)
+{
+	size_t done;
+	ssize_t n;
+
+	for (done=0;done<records->length;done+=n) {
+		n = write(file->fd, records->buffer+done, records->length-done);
+		if (n < 0) {
+			perror("Could not write match log");
+			return false;
+		}
+	}
+	return true;
+}
+
+void *snake_writer_run(void *arg)
+{
+	bool failed;
+	struct snake_log_write_t *item;
+	struct snake_writer_t *writer = (struct snake_writer_t *)arg;
+
+	pthread_mutex_lock(&writer->lock);
+	for (;;) {
+		while (!writer->first && !writer->stopping) {
+			pthread_cond_wait(&writer->cond, &writer->lock);
+		}
+		if (!writer->first) {
+			break;
+		}
+		item = writer->first;
+		writer->first = item->next;
+		if (!writer->first) {
+			writer->last = NULL;
+		}
+		failed = item->file->failed;
+		pthread_mutex_unlock(&writer->lock);
+		if (!item->records) {
+			close(item->file->fd);
+		} else if (!failed) {
+			failed = !snake_log_write(item->file, item->records);
+		}
+		pthread_mutex_lock(&writer->lock);
+		if (item->records) {
+			strbuf_destroy(item->records);
+			item->file->failed = failed;
+			item->file->pending--;
+			writer->nbuffers--;
+		} else {
+			free(item->file);
+		}
+		free(item);
+		pthread_cond_broadcast(&writer->done);
+	}
+	pthread_mutex_unlock(&writer->lock);
+	return NULL;
+}
+
+// what is handed over is written before the process ends
+void snake_writer_stop()
+{
+	pthread_mutex_lock(&snake_writer.lock);
+	snake_writer.stopping = true;
+	pthread_cond_signal(&snake_writer.cond);
+	pthread_mutex_unlock(&snake_writer.lock);
+	pthread_join(snake_writer.thread, NULL);
+}
+
+void snake_writer_start()
+{
+	if (pthread_create(&snake_writer.thread, NULL, snake_writer_run, &snake_writer) != 0) {
+		fprintf(stderr, "Could not start the match log writer\n");
+		exit(EXIT_FAILURE);
+	}
+	atexit(snake_writer_stop);
+}
+
+void snake_writer_push(struct snake_log_file_t *file, strbuf_t *records)
+{
+	struct snake_log_write_t *item = malloc(sizeof(*item));
+
+	item->file = file;
+	item->records = records;
+	item->next = NULL;
+	if (snake_writer.last) {
+		snake_writer.last->next = item;
+	} else {
+		snake_writer.first = item;
+	}
+	snake_writer.last = item;
+	if (records) {
+		snake_writer.nbuffers++;
+		file->pending++;
+	}
+	pthread_cond_signal(&snake_writer.cond);
+}
+
+void snake_log_attach(snake_t *snake, int fd)
+{
+	pthread_once(&snake_writer_once, snake_writer_start);
+	snake->log_file = malloc(sizeof(*snake->log_file));
+	snake->log_file->fd = fd;
+	snake->log_file->failed = false;
+	snake->log_file->pending = 0;
+	snake->log = strbuf_create();
+}
+
+// the writer closes the file once it wrote what the room handed it
+void snake_log_close(snake_t *snake)
+{
+	pthread_mutex_lock(&snake_writer.lock);
+	snake_writer_push(snake->log_file, NULL);
+	pthread_mutex_unlock(&snake_writer.lock);
+	strbuf_destroy(snake->log);
+	snake->log = NULL;
+	snake->log_file = NULL;
+}
+
+// hands the records to the writer, a log that failed or fell behind is
+// given up on, as a replay cannot get past a gap
+void snake_log_flush(snake_t *snake)
+{
+	bool failed, full;
+	unsigned int dropped;
+
+	if (!snake->log->length) {
+		return;
+	}
+	pthread_mutex_lock(&snake_writer.lock);
+	failed = snake->log_file->failed;
+	full = snake_writer.nbuffers >= SNAKE_LOG_QUEUE;
+	if (full) {
+		snake_writer.dropped++;
+	} else if (!failed) {
+		snake_writer_push(snake->log_file, snake->log);
+	}
+	dropped = snake_writer.dropped;
+	pthread_mutex_unlock(&snake_writer.lock);
+	if (full) {
+		fprintf(stderr, "Match log fell behind and was given up, %u so far\n", dropped);
+	}
+	if (failed || full) {
+		snake_log_close(snake);
+		return;
+	}
+	snake->log = strbuf_create();
+}
+
+// everything the room logged is written, for a process that goes on with
+// the same file
+void snake_log_sync(snake_t *snake)
+{
+	bool failed;
+
+	snake_log_flush(snake);
+	if (!snake->log) {
+		return;
+	}
+	pthread_mutex_lock(&snake_writer.lock);
+	while (snake->log_file->pending) {
+		pthread_cond_wait(&snake_writer.done, &snake_writer.lock);
+	}
+	failed = snake->log_file->failed;
+	pthread_mutex_unlock(&snake_writer.lock);
+	if (failed) {
+		snake_log_close(snake);
+	}
+}
+
+bool snake_log_open(snake_t *snake, const char *filename)
+{
+	int fd;
+
+	fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("Could not open match log");
+		return false;
+	}
+	// a new process gets the log sent on an upgrade, it must not inherit it
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	snake_log_attach(snake, fd);
+	strbuf_append_literal(snake->log, SNAKE_LOG_MAGIC);
+	snake_log_u32(snake->log, SNAKE_LOG_VERSION);
+	snake_log_u32(snake->log, snake->width);
+	snake_log_u32(snake->log, snake->height);
+	snake_log_u32(snake->log, snake->nplayers);
+	snake_log_u32(snake->log, snake->seed);
+	return true;
+}
+
+// the players are all the state food does not follow from, cheap enough to
+// hash while the match runs so a replay can tell where it went another way
+uint32_t snake_checksum(snake_t *snake)
+{
+	int i;
+	uint32_t hash = 2166136261U;
+	struct snake_player_t *p;
+
+	for (i=0;i<snake->nplayers;i++) {
+		p = &snake->players[i];
+		hash = (hash ^ p->alive) * 16777619U;
+		hash = (hash ^ p->length) * 16777619U;
+		hash = (hash ^ p->head.x) * 16777619U;
+		hash = (hash ^ p->head.y) * 16777619U;
+	}
+	return hash;
+}
+
+void snake_event(snake_t *snake, int event, int seat)
+{
+	strbuf_append_char(snake->events, (char)event);
+	wire_append_varint(snake->events, seat);
+	snake->nevents++;
+}
+
+// the events went out with the frame of this tick
+void snake_clear_events(snake_t *snake)
+{
+	strbuf_reset(snake->events);
+	snake->nevents = 0;
+}
+
 void snake_destroy(snake_t *snake)
 {
-	free(snake->fields);
-	free(snake->previous_fields);
-	free(snake->directions);
+	int i;
+
+	if (snake->log) {
+		snake_log_flush(snake);
+	}
+	if (snake->log) {
+		snake_log_close(snake);
+	}
+
+	free(snake->cells);
+	free(snake->blank);
+	diff_destroy(snake->diff);
+	free(snake->dirty);
+	for (i=0;i<SNAKE_HISTORY;i++) {
+		free(snake->history[i].cells);
+	}
+	for (i=0;i<2;i++) {
+		if (snake->keyframes[i]) {
+			daemon_frame_release(snake->keyframes[i]);
+		}
+	}
+	free(snake->views);
+	free(snake->index);
+	free(snake->spots);
+	free(snake->targets);
 	free(snake->players);
+	strbuf_destroy(snake->events);
+	strbuf_destroy(snake->sb);
 	free(snake);
 }
 
+// the slot of a cell, or the free slot where it goes
+static inline struct snake_target_t *snake_find_target(snake_t *snake, int cell)
+{
+	unsigned int slot = ((unsigned int)cell * 2654435761U) & snake->targets_mask;
+
+	while (snake->targets[slot].cell >= 0 && snake->targets[slot].cell != cell) {
+		slot = (slot + 1) & snake->targets_mask;
+	}
+	return &snake->targets[slot];
+}
+
+// all heads move at once, so the board is only read here and the outcome
+// does not depend on the order of the seats: heads that meet on a cell all
+// crash, and a tail that moves on this tick leaves its cell free
+void snake_resolve(snake_t *snake)
+{
+	int player, cell;
+	snake_cell_t value;
+	struct snake_player_t *p;
+	struct snake_target_t *target;
+
+	memset(snake->targets,0xff,(snake->targets_mask+1)*sizeof(*snake->targets));
+	for (player=0;player<snake->nplayers;player++) {
+		p = &snake->players[player];
+		if (p->alive) {
+			cell = snake_offset(snake,&p->head);
+			p->eats = snake_kind(snake_read(snake,cell))==kind_food;
+			target = snake_find_target(snake,cell);
+			target->heads = target->cell < 0 ? 1 : target->heads + 1;
+			target->cell = cell;
+		}
+	}
+	for (player=0;player<snake->nplayers;player++) {
+		p = &snake->players[player];
+		if (p->alive) {
+			cell = snake_offset(snake,&p->head);
+			value = snake_read(snake,cell);
+			switch (snake_kind(value)) {
+				case kind_empty:
+				case kind_food:
+					p->crashes = false;
+					break;
+				case kind_tail:
+					p->crashes = !snake->players[snake_owner(value)].alive || snake->players[snake_owner(value)].eats;
+					break;
+				default:
+					p->crashes = true;
+					break;
+			}
+			p->crashes = p->crashes || snake_find_target(snake,cell)->heads > 1;
+		}
+	}
+}
+
 void snake_move_tails(snake_t *snake)
 {
 	int player;
-	struct snake_position_t *head, *tail, *previous_head, *previous_tail;
+	struct snake_position_t *tail, *previous_tail;
 
 	// move tail out of the way (if not scored)
 	for (player=0;player<snake->nplayers;player++) {
 		if (snake->players[player].alive) {
-			head = &snake->players[player].head;
 			tail = &snake->players[player].tail;
-			previous_head = &snake->players[player].previous_head;
 			previous_tail = &snake->players[player].previous_tail;
-			// did we move?
-			if (snake_get_field(snake,head)==0) {
+			if (!snake->players[player].eats) {
 				// update field
 				snake_set_direction(snake,previous_tail,none);
-				snake_set_field(snake,previous_tail,0);
-				snake_set_field(snake,tail,12+player*10);
-			} else if (snake_get_field(snake,head)==1) {
+				snake_set_kind(snake,previous_tail,kind_empty,0);
+				snake_set_kind(snake,tail,kind_tail,player);
+			} else {
 				// food, increase length, no tail move
 				snake->players[player].length++;
 				*tail = *previous_tail;
+				snake_event(snake,event_eat,player);
 			}
 		}
 	}
@@ -138,23 +728,23 @@ void snake_move_heads(snake_t *snake)
 	char direction;
 	struct snake_position_t *head, *previous_head;
 
-	// try to move head
+	// move the heads that did not crash
 	for (player=0;player<snake->nplayers;player++) {
 		if (snake->players[player].alive) {
 			head = &snake->players[player].head;
 			previous_head = &snake->players[player].previous_head;
 			direction = snake->players[player].direction;
-			// if we hit something that can be eaten
-			if (snake_get_field(snake,head)<10) {
+			if (!snake->players[player].crashes) {
 				snake_set_direction(snake,previous_head,direction);
 				snake_set_direction(snake,head,direction);
 				if (snake->players[player].length>2) {
-					snake_set_field(snake,previous_head,11+player*10);
+					snake_set_kind(snake,previous_head,kind_body,player);
 				}
-				snake_set_field(snake,head,10+player*10);
+				snake_set_kind(snake,head,kind_head,player);
 			} else {
 				// you have hit something that kills you
 				snake->players[player].alive = false;
+				snake_event(snake,event_die,player);
 			}
 		}
 	}
@@ -197,189 +787,1196 @@ void snake_update_coordinates(snake_t *snake)
 	}
 }
 
-void snake_next_frame(snake_t *snake)
+// the written cells of the frame that went out become part of the board,
+// cells written after it, like a join between ticks, go with the next one
+void snake_commit(snake_t *snake)
 {
-	size_t field_size;
+	int i;
 
-	field_size = snake->width*snake->height*sizeof(*snake->fields);
-	memcpy(snake->previous_fields,snake->fields,field_size);
+	for (i=0;i<snake->ndirty;i++) {
+		snake->cells[snake->dirty[i].cell] &= ~SNAKE_TOUCHED;
+	}
+	snake->ndirty = 0;
+}
 
+void snake_next_frame(snake_t *snake)
+{
 	snake_update_coordinates(snake);
+	snake_resolve(snake);
 	snake_move_tails(snake);
 	snake_move_heads(snake);
 }
 
+// none, down, up, right, left
+static const char snake_heads[] = "  ..'' :: ";
+
+// draw a cell of the world at column x and row y of the screen
+void snake_draw_cell(snake_t *snake, term_t *term, int cell, int x, int y)
+{
+	snake_cell_t value;
+	bool bold;
+	int fg, bg;
+	const char *glyph;
+
+	value = snake_read(snake,cell);
+	bold = false;
+	fg = 0;
+	// a head, body and tail for every player, in a color of its own
+	switch(snake_kind(value)) {
+		case kind_empty: bg = 0; glyph = "  "; break;
+		case kind_food:  bold = true; fg = 7; bg = 0; glyph = "<>"; break;
+		case kind_head:  bg = 1 + snake_owner(value)%6; glyph = snake_heads+snake_direction(value)*2; break;
+		default:         bg = 1 + snake_owner(value)%6; glyph = "  "; break;
+	}
+	// every cell is two columns wide
+	term_move(term,y,x*2);
+	term_sgr(term,bold,fg,bg);
+	term_text(term,glyph,2);
+}
+
+int snake_compare_cells(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+int snake_compare_changes(const void *a, const void *b)
+{
+	return ((const struct snake_change_t *)a)->cell - ((const struct snake_change_t *)b)->cell;
+}
+
+// sort the written cells and keep the ones that look different than in the
+// last frame, the others are done with for this frame
+void snake_collect(snake_t *snake)
+{
+	int i, n, cell;
+
+	qsort(snake->dirty,snake->ndirty,sizeof(*snake->dirty),snake_compare_changes);
+	n = 0;
+	for (i=0;i<snake->ndirty;i++) {
+		cell = snake->dirty[i].cell;
+		if (snake_look(snake_read(snake,cell))!=snake_look(snake->dirty[i].old)) {
+			snake->dirty[n++] = snake->dirty[i];
+		} else {
+			snake->cells[cell] &= ~SNAKE_TOUCHED;
+		}
+	}
+	snake->ndirty = n;
+}
+
+// called with constants for the classic board, so that copy of the loop
+// has no divisions or loads of the size left
+static inline void snake_draw_board(snake_t *snake, term_t *term, int width, int height)
+{
+	int x, y;
+
+	for (y=0;y<height;y++) {
+		for (x=0;x<width;x++) {
+			snake_draw_cell(snake,term,y*width+x,x,y);
+		}
+	}
+}
+
+static inline void snake_draw_dirty(snake_t *snake, term_t *term, int width)
+{
+	int i, cell;
+
+	for (i=0;i<snake->ndirty;i++) {
+		cell = snake->dirty[i].cell;
+		snake_draw_cell(snake,term,cell,cell%width,cell/width);
+	}
+}
+
+bool snake_classic(snake_t *snake)
+{
+	return snake->width == SNAKE_VIEW_WIDTH && snake->height == SNAKE_VIEW_HEIGHT;
+}
+
 void snake_get_frame(snake_t *snake, strbuf_t *sb, bool full)
 {
-	int x, y, cx, cy;
-	char c, d, p;
+	term_t term;
 
+	term_start(&term,sb,snake->width*2);
 	if (full) {
-		strbuf_append(sb,"\e[?25l\e[2J");
-	}
-	strbuf_append(sb,"\e[H");
-
-	// none, down, up, right, left
-	char heads[] = "  ..'' :: ";
-
-	cx = cy = 0;
-	for (y=0;y<snake->height;y++) {
-		for (x=0;x<snake->width;x++) {
-			c=snake_get(snake->fields,snake->width,snake->height,x,y);
-			p=snake_get(snake->previous_fields,snake->width,snake->height,x,y);
-			if (c!=p || full) {
-				if (x==0 && y==cy+1) { // new line?
-					strbuf_append(sb,"\n");
-				} else if (cx!=x || cy!=y) { // move cursor
-					strbuf_append(sb,"\e[%d;%dH",y+1,x*2+1);
+		strbuf_append_literal(sb,"\e[?25l\e[2J");
+		if (snake_classic(snake)) {
+			snake_draw_board(snake,&term,SNAKE_VIEW_WIDTH,SNAKE_VIEW_HEIGHT);
+		} else {
+			snake_draw_board(snake,&term,snake->width,snake->height);
+		}
+		return;
+	}
+	// the delta walks the changed cells in board order, not the board
+	snake_collect(snake);
+	if (snake_classic(snake)) {
+		snake_draw_dirty(snake,&term,SNAKE_VIEW_WIDTH);
+	} else {
+		snake_draw_dirty(snake,&term,snake->width);
+	}
+}
+
+// a binary client starts a keyframe from an empty view, a board has its top
+// left at the origin
+void snake_wire_keyframe(snake_t *snake, wire_t *wire, strbuf_t *sb, struct snake_view_t *view)
+{
+	wire_start(wire,sb,message_keyframe);
+	wire_varint(wire,snake->width);
+	wire_varint(wire,snake->height);
+	wire_varint(wire,snake->view_width);
+	wire_varint(wire,snake->view_height);
+	wire_varint(wire,view ? view->x : 0);
+	wire_varint(wire,view ? view->y : 0);
+}
+
+// a catch up spans several frames and leaves their events out
+void snake_wire_delta(snake_t *snake, wire_t *wire, strbuf_t *sb, int dx, int dy, bool events)
+{
+	wire_start(wire,sb,message_delta);
+	wire_signed(wire,dx);
+	wire_signed(wire,dy);
+	wire_varint(wire,events ? snake->nevents : 0);
+	if (events) {
+		wire_bytes(wire,snake->events->buffer,snake->events->length);
+	}
+}
+
+// the board for a binary client, the cells are numbered like on the board
+void snake_get_wire_frame(snake_t *snake, strbuf_t *sb, bool full)
+{
+	int i, cell, end;
+	unsigned int value;
+	wire_t wire;
+
+	// the vector kernel skips the empty stretches of a large board, an
+	// empty cell may still have a direction
+	if (full) {
+		snake_wire_keyframe(snake,&wire,sb,NULL);
+		diff_words(snake->diff,snake->cells,snake->blank,snake->width*snake->height,
+				(uint32_t)~(SNAKE_TOUCHED|SNAKE_DIRECTION_MASK));
+		for (i=0;i<snake->diff->nruns;i++) {
+			end = snake->diff->runs[i].start + snake->diff->runs[i].length;
+			for (cell=snake->diff->runs[i].start;cell<end;cell++) {
+				value = snake_wire_value(snake_read(snake,cell));
+				if (value) {
+					wire_cell(&wire,cell,value);
+				}
+			}
+		}
+		wire_end(&wire);
+		return;
+	}
+	snake_collect(snake);
+	snake_wire_delta(snake,&wire,sb,0,0,true);
+	for (i=0;i<snake->ndirty;i++) {
+		cell = snake->dirty[i].cell;
+		wire_cell(&wire,cell,snake_wire_value(snake_read(snake,cell)));
+	}
+	wire_end(&wire);
+}
+
+// remember the changes of the frame that was just rendered as a delta
+void snake_record(snake_t *snake)
+{
+	int i;
+	struct snake_history_t *history = &snake->history[snake->frame%SNAKE_HISTORY];
+
+	if (history->size < snake->ndirty) {
+		history->size = snake->ndirty;
+		history->cells = realloc(history->cells,history->size*sizeof(*history->cells));
+	}
+	for (i=0;i<snake->ndirty;i++) {
+		history->cells[i] = snake->dirty[i].cell;
+	}
+	history->ncells = snake->ndirty;
+}
+
+// everything that changed after the given frame, drawn as it is now, or
+// false when that frame is too old to be in the history
+bool snake_get_catchup(snake_t *snake, strbuf_t *sb, uint64_t since, bool binary)
+{
+	int i, n, cell, *cells;
+	uint64_t frame;
+	struct snake_history_t *history;
+	term_t term;
+	wire_t wire;
+
+	if (!since || snake->frame - since > SNAKE_HISTORY) {
+		return false;
+	}
+	n = 0;
+	for (frame=since+1;frame<=snake->frame;frame++) {
+		n += snake->history[frame%SNAKE_HISTORY].ncells;
+	}
+	cells = malloc((n ? n : 1)*sizeof(*cells));
+	n = 0;
+	for (frame=since+1;frame<=snake->frame;frame++) {
+		history = &snake->history[frame%SNAKE_HISTORY];
+		memcpy(cells+n,history->cells,history->ncells*sizeof(*cells));
+		n += history->ncells;
+	}
+	qsort(cells,n,sizeof(*cells),snake_compare_cells);
+	if (binary) {
+		snake_wire_delta(snake,&wire,sb,0,0,false);
+		for (i=0;i<n;i++) {
+			if (!i || cells[i]!=cells[i-1]) {
+				wire_cell(&wire,cells[i],snake_wire_value(snake_read(snake,cells[i])));
+			}
+		}
+		wire_end(&wire);
+		free(cells);
+		return true;
+	}
+	term_start(&term,sb,snake->width*2);
+	for (i=0;i<n;i++) {
+		cell = cells[i];
+		if (!i || cell!=cells[i-1]) {
+			snake_draw_cell(snake,&term,cell,cell%snake->width,cell/snake->width);
+		}
+	}
+	free(cells);
+	return true;
+}
+
+bool snake_scrolling(snake_t *snake)
+{
+	return snake->width > snake->view_width || snake->height > snake->view_height;
+}
+
+int snake_compare_keys(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// order the changed cells of the frame by chunk
+void snake_index(snake_t *snake)
+{
+	int i, cell, x, y;
+
+	if (snake->index_size < snake->ndirty) {
+		snake->index_size = snake->ndirty;
+		snake->index = realloc(snake->index,snake->index_size*sizeof(*snake->index));
+	}
+	for (i=0;i<snake->ndirty;i++) {
+		cell = snake->dirty[i].cell;
+		x = cell % snake->width;
+		y = cell / snake->width;
+		snake->index[i] = (uint64_t)(y/SNAKE_CHUNK*snake->chunks + x/SNAKE_CHUNK) << 32 | (uint32_t)cell;
+	}
+	snake->nindex = snake->ndirty;
+	qsort(snake->index,snake->nindex,sizeof(*snake->index),snake_compare_keys);
+}
+
+// position of the first changed cell in the chunk, or where it would be
+int snake_find_chunk(snake_t *snake, int chunk)
+{
+	int low, high, middle;
+
+	low = 0;
+	high = snake->nindex;
+	while (low < high) {
+		middle = (low + high) / 2;
+		if ((snake->index[middle] >> 32) < (uint64_t)chunk) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return low;
+}
+
+// how far a view moves along one axis to keep the head away from its
+// edges, a head that is out of view is centered
+int snake_follow_axis(int head, int origin, int size, int view)
+{
+	int offset, margin, shift;
+
+	if (view >= size) {
+		return 0;
+	}
+	offset = (head - origin + size) % size;
+	margin = view / 4;
+	if (offset >= view) {
+		shift = offset - view / 2;
+		return shift > size / 2 ? shift - size : shift;
+	}
+	if (offset < margin) {
+		return offset - margin;
+	}
+	if (offset >= view - margin) {
+		return offset - (view - margin - 1);
+	}
+	return 0;
+}
+
+// the head a view follows, the view after the seats is the spectators'
+static inline struct snake_position_t *snake_camera(snake_t *snake, int seat)
+{
+	return &snake->players[seat < snake->nplayers ? seat : snake->watched].head;
+}
+
+void snake_follow(snake_t *snake, int seat, int *dx, int *dy)
+{
+	struct snake_view_t *view = &snake->views[seat];
+	struct snake_position_t *head = snake_camera(snake,seat);
+
+	*dx = snake_follow_axis(head->x,view->x,snake->width,snake->view_width);
+	*dy = snake_follow_axis(head->y,view->y,snake->height,snake->view_height);
+	view->x = (view->x + *dx + snake->width) % snake->width;
+	view->y = (view->y + *dy + snake->height) % snake->height;
+}
+
+void snake_center(snake_t *snake, int seat)
+{
+	struct snake_view_t *view = &snake->views[seat];
+	struct snake_position_t *head = snake_camera(snake,seat);
+
+	view->x = (head->x - snake->view_width/2 + snake->width) % snake->width;
+	view->y = (head->y - snake->view_height/2 + snake->height) % snake->height;
+	if (snake->view_width == snake->width) {
+		view->x = 0;
+	}
+	if (snake->view_height == snake->height) {
+		view->y = 0;
+	}
+}
+
+// whether a row or column came into view with the last scroll
+bool snake_uncovered(int position, int shift, int size)
+{
+	return shift > 0 ? position >= size - shift : position < -shift;
+}
+
+// columns from up to to of a row of the view, wrapping without a division
+// per cell
+void snake_draw_view_row(snake_t *snake, term_t *term, struct snake_view_t *view, int y, int from, int to)
+{
+	int x, wx, row;
+
+	row = (view->y + y) % snake->height * snake->width;
+	wx = (view->x + from) % snake->width;
+	for (x=from;x<to;x++) {
+		snake_draw_cell(snake,term,row+wx,x,y);
+		if (++wx == snake->width) {
+			wx = 0;
+		}
+	}
+}
+
+// the changed cells of the frame that are in view and were not scrolled
+// in, looked up by the chunks that overlap the view
+void snake_find_changes(snake_t *snake, struct snake_view_t *view, int dx, int dy)
+{
+	int i, sx, sy, wx, wy, lx, ly, x, y, cell, chunk;
+
+	snake->nspots = 0;
+	for (sy=0;sy<snake->view_height;sy+=ly) {
+		wy = (view->y + sy) % snake->height;
+		ly = SNAKE_CHUNK - wy % SNAKE_CHUNK;
+		ly = ly < snake->view_height - sy ? ly : snake->view_height - sy;
+		ly = ly < snake->height - wy ? ly : snake->height - wy;
+		for (sx=0;sx<snake->view_width;sx+=lx) {
+			wx = (view->x + sx) % snake->width;
+			lx = SNAKE_CHUNK - wx % SNAKE_CHUNK;
+			lx = lx < snake->view_width - sx ? lx : snake->view_width - sx;
+			lx = lx < snake->width - wx ? lx : snake->width - wx;
+			chunk = wy / SNAKE_CHUNK * snake->chunks + wx / SNAKE_CHUNK;
+			// a chunk can be visited twice when the view wraps, so only
+			// the part of it that this visit covers is taken
+			for (i=snake_find_chunk(snake,chunk);i<snake->nindex && (int)(snake->index[i] >> 32)==chunk;i++) {
+				cell = (int)(uint32_t)snake->index[i];
+				x = cell % snake->width - wx;
+				y = cell / snake->width - wy;
+				if (x < 0 || x >= lx || y < 0 || y >= ly) {
+					continue;
+				}
+				x += sx;
+				y += sy;
+				if (snake_uncovered(x,dx,snake->view_width) || snake_uncovered(y,dy,snake->view_height)) {
+					continue;
 				}
-				// get direction
-				d=snake_get(snake->directions,snake->width,snake->height,x,y);
-				// draw and increment cx
-				switch(c) {
-					case 0:  strbuf_append(sb,"\e[0;30;40m  "); break;
-					case 1:  strbuf_append(sb,"\e[1;37;40m<>"); break;
-					case 10: strbuf_append(sb,"\e[0;30;41m%c%c",heads[d*2],heads[d*2+1]); break;
-					case 11: strbuf_append(sb,"\e[0;30;41m  "); break;
-					case 12: strbuf_append(sb,"\e[0;30;41m  "); break;
-					case 20: strbuf_append(sb,"\e[0;30;42m%c%c",heads[d*2],heads[d*2+1]); break;
-					case 21: strbuf_append(sb,"\e[0;30;42m  "); break;
-					case 22: strbuf_append(sb,"\e[0;30;42m  "); break;
+				if (snake->nspots == snake->spots_size) {
+					snake->spots_size = snake->spots_size ? snake->spots_size*2 : 64;
+					snake->spots = realloc(snake->spots,snake->spots_size*sizeof(*snake->spots));
 				}
-				cx++;
+				snake->spots[snake->nspots++] = (uint64_t)(y*snake->view_width + x) << 32 | (uint32_t)cell;
 			}
 		}
 	}
+}
+
+// the view of a seat after it scrolled by dx and dy, where a delta scrolls
+// what the client has and draws the cells that came into view or changed
+void snake_get_view(snake_t *snake, strbuf_t *sb, int seat, int dx, int dy, bool full)
+{
+	int i, y, width, height, position;
+	struct snake_view_t *view = &snake->views[seat];
+	term_t term;
 
+	width = snake->view_width;
+	height = snake->view_height;
+	term_start(&term,sb,width*2);
+	if (full || abs(dx) >= width || abs(dy) >= height) {
+		strbuf_append_literal(sb,"\e[?25l");
+		term_region(&term,height);
+		strbuf_append_literal(sb,"\e[2J");
+		for (y=0;y<height;y++) {
+			snake_draw_view_row(snake,&term,view,y,0,width);
+		}
+		return;
+	}
+	if (dy) {
+		term_scroll(&term,dy);
+	}
+	for (y=0;y<height;y++) {
+		if (snake_uncovered(y,dy,height)) {
+			snake_draw_view_row(snake,&term,view,y,0,width);
+			continue;
+		}
+		// shifting the row left pulls in blanks from the right, shifting
+		// it right first drops its end so nothing is pushed past the view
+		if (dx > 0) {
+			term_move(&term,y,0);
+			term_delete(&term,dx*2);
+			snake_draw_view_row(snake,&term,view,y,width-dx,width);
+		} else if (dx < 0) {
+			term_move(&term,y,(width+dx)*2);
+			term_delete(&term,-dx*2);
+			term_move(&term,y,0);
+			term_insert(&term,-dx*2);
+			snake_draw_view_row(snake,&term,view,y,0,-dx);
+		}
+	}
+	snake_find_changes(snake,view,dx,dy);
+	for (i=0;i<snake->nspots;i++) {
+		position = (int)(snake->spots[i] >> 32);
+		snake_draw_cell(snake,&term,(int)(uint32_t)snake->spots[i],position%width,position/width);
+	}
 }
 
-void on_tick(daemon_t *daemon, int tick)
+// the cells of a row of the view that have something on them, the client
+// has the rest empty already
+void snake_wire_view_row(snake_t *snake, wire_t *wire, struct snake_view_t *view, int y, int from, int to)
+{
+	int x, wx, row;
+	unsigned int value;
+
+	row = (view->y + y) % snake->height * snake->width;
+	wx = (view->x + from) % snake->width;
+	for (x=from;x<to;x++) {
+		value = snake_wire_value(snake_read(snake,row+wx));
+		if (value) {
+			wire_cell(wire,y*snake->view_width+x,value);
+		}
+		if (++wx == snake->width) {
+			wx = 0;
+		}
+	}
+}
+
+// the changed cells of a row, which are sorted by position
+static inline int snake_wire_spots(snake_t *snake, wire_t *wire, int i, int y)
+{
+	int end = (y + 1) * snake->view_width;
+
+	for (;i<snake->nspots && (int)(snake->spots[i] >> 32) < end;i++) {
+		wire_cell(wire,(int)(snake->spots[i] >> 32),snake_wire_value(snake_read(snake,(int)(uint32_t)snake->spots[i])));
+	}
+	return i;
+}
+
+// the same view for a binary client, which shifts what it has itself, so the
+// cells come in order of position with the scrolled in ones on either side
+// of the changed ones in a row
+void snake_get_wire_view(snake_t *snake, strbuf_t *sb, int seat, int dx, int dy, bool full)
+{
+	int i, y, width, height;
+	struct snake_view_t *view = &snake->views[seat];
+	wire_t wire;
+
+	width = snake->view_width;
+	height = snake->view_height;
+	if (full) {
+		snake_wire_keyframe(snake,&wire,sb,view);
+	} else {
+		snake_wire_delta(snake,&wire,sb,dx,dy,true);
+	}
+	// a jump has nothing in view that the client had
+	if (full || abs(dx) >= width || abs(dy) >= height) {
+		for (y=0;y<height;y++) {
+			snake_wire_view_row(snake,&wire,view,y,0,width);
+		}
+		wire_end(&wire);
+		return;
+	}
+	snake_find_changes(snake,view,dx,dy);
+	qsort(snake->spots,snake->nspots,sizeof(*snake->spots),snake_compare_keys);
+	i = 0;
+	for (y=0;y<height;y++) {
+		if (snake_uncovered(y,dy,height)) {
+			snake_wire_view_row(snake,&wire,view,y,0,width);
+			continue;
+		}
+		if (dx < 0) {
+			snake_wire_view_row(snake,&wire,view,y,0,-dx);
+		}
+		i = snake_wire_spots(snake,&wire,i,y);
+		if (dx > 0) {
+			snake_wire_view_row(snake,&wire,view,y,width-dx,width);
+		}
+	}
+	wire_end(&wire);
+}
+
+// a text frame ends in a zero byte, a binary message knows its length
+daemon_frame_t *snake_frame(snake_t *snake, bool binary)
+{
+	daemon_frame_t *frame = daemon_frame_create(snake->sb->buffer,snake->sb->length+!binary);
+
+	frame->id = snake->frame;
+	return frame;
+}
+
+void snake_send_view(lobby_room_t *room, int seat, bool full)
+{
+	snake_t *snake = (snake_t *)room->context;
+	strbuf_t *sb = snake->sb;
+	daemon_frame_t *frame;
+	int dx, dy;
+	bool binary = room->daemon->client_binary[room->clients[seat]];
+
+	dx = dy = 0;
+	if (!full) {
+		snake_follow(snake,seat,&dx,&dy);
+	}
+	strbuf_reset(sb);
+	if (binary) {
+		snake_get_wire_view(snake, sb, seat, dx, dy, full);
+	} else {
+		snake_get_view(snake, sb, seat, dx, dy, full);
+	}
+	frame = snake_frame(snake, binary);
+	daemon_write_frame(room->daemon,room->clients[seat],frame);
+	daemon_frame_release(frame);
+}
+
+// the spectators watch the longest snake, and keep watching it until it dies
+// or another one grows longer
+void snake_watch_leader(snake_t *snake)
+{
+	int seat, watched;
+	struct snake_player_t *players = snake->players;
+
+	watched = snake->watched;
+	for (seat=0;seat<snake->nplayers;seat++) {
+		if (players[seat].alive && (!players[watched].alive || players[seat].length > players[watched].length)) {
+			watched = seat;
+		}
+	}
+	snake->watched = watched;
+}
+
+// the board changed since the keyframes were rendered
+void snake_release_keyframes(snake_t *snake)
 {
 	int i;
 
-	snake_t *snake = (snake_t *)daemon->context;
+	for (i=0;i<2;i++) {
+		if (snake->keyframes[i]) {
+			daemon_frame_release(snake->keyframes[i]);
+			snake->keyframes[i] = NULL;
+		}
+	}
+}
 
-	strbuf_t *sb = strbuf_create();
+// a full frame can be far larger than the deltas, so the memory it took
+// is given back instead of staying reserved for the room
+daemon_frame_t *snake_get_keyframe(snake_t *snake, bool binary)
+{
+	strbuf_t *sb = snake->sb;
 
+	if (!snake->keyframes[binary]) {
+		strbuf_reset(sb);
+		// a large world has no board to show, only the spectators' view
+		if (snake_scrolling(snake) && binary) {
+			snake_get_wire_view(snake, sb, snake->nplayers, 0, 0, true);
+		} else if (snake_scrolling(snake)) {
+			snake_get_view(snake, sb, snake->nplayers, 0, 0, true);
+		} else if (binary) {
+			snake_get_wire_frame(snake, sb, true);
+		} else {
+			snake_get_frame(snake, sb, true);
+		}
+		snake->keyframes[binary] = snake_frame(snake, binary);
+		strbuf_shrink(sb, SNAKE_FRAME_KEEP);
+	}
+	return snake->keyframes[binary];
+}
+
+char snake_opposite(char direction)
+{
+	switch (direction) {
+		case down:  return up;
+		case up:    return down;
+		case right: return left;
+		case left:  return right;
+	}
+	return none;
+}
+
+// a turn is queued when it changes the direction the snake will have
+void snake_queue_turn(snake_t *snake, int seat, char direction)
+{
+	struct snake_player_t *player = &snake->players[seat];
+	char last;
+
+	if (player->nturns == SNAKE_TURNS) {
+		return;
+	}
+	if (player->nturns) {
+		last = player->turns[player->nturns-1];
+	} else {
+		last = snake_get_direction(snake, &player->head);
+	}
+	if (direction == last || direction == snake_opposite(last)) {
+		return;
+	}
+	player->turns[player->nturns++] = direction;
+	snake_log_op(snake, log_turn | direction << 4, seat);
+}
+
+// every tick applies at most one queued turn per player, in order
+void snake_apply_turns(snake_t *snake)
+{
+	int player;
+	struct snake_player_t *p;
+
+	for (player=0;player<snake->nplayers;player++) {
+		p = &snake->players[player];
+		if (!p->nturns) {
+			continue;
+		}
+		if (p->alive) {
+			p->direction = p->turns[0];
+		}
+		p->nturns--;
+		memmove(p->turns, p->turns+1, p->nturns);
+	}
+}
+
+// everything a tick changes on the board, which is what a replay redoes
+void snake_step(snake_t *snake, bool feed)
+{
+	int i, nfood;
+	struct snake_position_t food;
+
+	snake_log_op(snake, feed ? log_food : log_tick, -1);
+	snake_apply_turns(snake);
 	snake_next_frame(snake);
 
-	if (tick%100==0) {
-		int x = rand()%snake->width;
-		int y = rand()%snake->height;
-		if (snake_get(snake->fields,snake->width,snake->height,x,y)==0) {
-			snake_set(snake->fields,snake->width,snake->height,x,y,1);
+	if (feed) {
+		nfood = snake->width*snake->height/SNAKE_FOOD_AREA;
+		for (i=0;i<(nfood ? nfood : 1);i++) {
+			food.x = rand_r(&snake->seed)%snake->width;
+			food.y = rand_r(&snake->seed)%snake->height;
+			if (snake_get_kind(snake,&food)==kind_empty) {
+				snake_set_kind(snake,&food,kind_food,0);
+			}
+		}
+		if (snake->log) {
+			snake_log_op(snake, log_check, -1);
+			snake_log_u32(snake->log, snake_checksum(snake));
 		}
 	}
+	if (snake->log && snake->log->length >= SNAKE_LOG_FLUSH) {
+		snake_log_flush(snake);
+	}
+}
 
-	snake_get_frame(snake, sb, false);
+// a seat gets a snake the first time it is taken
+void snake_join(snake_t *snake, int seat)
+{
+	int i, first;
+	struct snake_player_t *player = &snake->players[seat];
+	// seats spread over the columns, a room with more seats than columns
+	// starts the rest two rows lower, behind the tails of the row above
+	int across = snake->nplayers < snake->width ? snake->nplayers : snake->width;
+	int x = seat % across * snake->width / across;
+	int y = seat / across * 2 % snake->height;
 
-	for(i=0;i<daemon->slots;i++) {
-		if (daemon->client_fd[i]==-1) continue;
-		daemon_write(daemon,i,sb->buffer,strlen(sb->buffer)+1);
+	snake_log_op(snake, log_join, seat);
+	if (player->length) {
+		return;
+	}
+	player->alive = true;
+	player->head.x = x;
+	player->head.y = (y+1) % snake->height;
+	player->previous_head = player->head;
+	player->tail.x = x;
+	player->tail.y = y;
+	player->previous_tail = player->tail;
+	player->length = 2;
+	player->direction = down;
+	snake_event(snake, event_join, seat);
+	first = snake->ndirty;
+	snake_set_direction(snake, &player->head, down);
+	snake_set_direction(snake, &player->tail, down);
+	// on the board right away, so no other head takes these cells
+	snake_set_kind(snake, &player->head, kind_head, seat);
+	snake_set_kind(snake, &player->tail, kind_tail, seat);
+	// seats that joined before got their keyframe without these cells and
+	// later ones with them, so the next delta sends them whatever they hold
+	for (i=first;i<snake->ndirty;i++) {
+		snake->dirty[i].old |= SNAKE_TOUCHED;
 	}
+}
 
-	strbuf_destroy(sb);
+void snake_leave(snake_t *snake, int seat)
+{
+	snake_log_op(snake, log_leave, seat);
+	snake_event(snake, event_leave, seat);
+	snake->players[seat].alive = false;
 }
 
-void on_data(daemon_t *daemon, int client)
+// a binary client learns which snake is its own
+void snake_send_seat(lobby_room_t *room, int seat)
 {
-	snake_t *snake = (snake_t *)daemon->context;
+	strbuf_t *sb = ((snake_t *)room->context)->sb;
+	wire_t wire;
 
-	int i,nbytes;
-	char direction;
-	char bytes[2048];
+	strbuf_reset(sb);
+	wire_start(&wire, sb, message_seat);
+	wire_varint(&wire, seat);
+	wire_end(&wire);
+	daemon_write(room->daemon, room->clients[seat], sb->buffer, sb->length);
+}
+
+// a client that switched to binary skipped the text it was sent, so it
+// starts over from a keyframe
+void snake_send_start(lobby_room_t *room, int seat)
+{
+	snake_t *snake = (snake_t *)room->context;
+
+	snake_send_seat(room, seat);
+	if (snake_scrolling(snake)) {
+		snake_send_view(room, seat, true);
+		return;
+	}
+	daemon_write_frame(room->daemon,room->clients[seat],snake_get_keyframe(snake, true));
+}
+
+// the frame of this tick in the protocol of a client, the spectators' view
+// has scrolled by dx and dy already
+daemon_frame_t *snake_render(snake_t *snake, bool binary, int dx, int dy)
+{
+	strbuf_t *sb = snake->sb;
+
+	strbuf_reset(sb);
+	if (snake_scrolling(snake) && binary) {
+		snake_get_wire_view(snake, sb, snake->nplayers, dx, dy, false);
+	} else if (snake_scrolling(snake)) {
+		snake_get_view(snake, sb, snake->nplayers, dx, dy, false);
+	} else if (binary) {
+		snake_get_wire_frame(snake, sb, false);
+	} else {
+		snake_get_frame(snake, sb, false);
+	}
+	return snake_frame(snake, binary);
+}
+
+// a frame is only rendered in a protocol once a client needs it, and then
+// every client of that protocol only holds a reference
+void snake_broadcast(lobby_room_t *room, daemon_frame_t **frames, int *clients, int nclients, int dx, int dy)
+{
+	int i;
+	bool binary;
+
+	for (i=0;i<nclients;i++) {
+		if (clients[i] < 0) {
+			continue;
+		}
+		binary = room->daemon->client_binary[clients[i]];
+		if (!frames[binary]) {
+			frames[binary] = snake_render((snake_t *)room->context, binary, dx, dy);
+		}
+		daemon_write_frame(room->daemon,clients[i],frames[binary]);
+	}
+}
+
+void on_tick(lobby_room_t *room, int tick)
+{
+	int i, seat, dx, dy;
+	daemon_frame_t *frames[2] = { NULL, NULL };
+
+	snake_t *snake = (snake_t *)room->context;
+
+	snake_step(snake, tick%100==0);
 
-	nbytes = daemon_read(daemon, client, bytes, sizeof(bytes));
+	snake->frame++;
+	snake_release_keyframes(snake);
+	snake_collect(snake);
+	dx = dy = 0;
+	// every seat sees another part of the world, so gets a frame of its own
+	if (snake_scrolling(snake)) {
+		snake_index(snake);
+		for (seat=0;seat<room->size;seat++) {
+			if (room->clients[seat] >= 0) {
+				snake_send_view(room, seat, false);
+			}
+		}
+		// without spectators the view is only kept on the leader
+		snake_watch_leader(snake);
+		if (room->spectators.nclients) {
+			snake_follow(snake, snake->nplayers, &dx, &dy);
+		} else {
+			snake_center(snake, snake->nplayers);
+		}
+	} else {
+		snake_record(snake);
+		snake_broadcast(room, frames, room->clients, room->size, dx, dy);
+	}
+	snake_broadcast(room, frames, room->spectators.clients, room->spectators.nclients, dx, dy);
+	for (i=0;i<2;i++) {
+		if (frames[i]) {
+			daemon_frame_release(frames[i]);
+		}
+	}
+	snake_clear_events(snake);
+	snake_commit(snake);
+}
+
+// a binary client sends the direction to turn to as a byte
+void on_data(lobby_room_t *room, int seat)
+{
+	snake_t *snake = (snake_t *)room->context;
+
+	int i,nbytes,client;
+	char bytes[DAEMON_INPUT];
+
+	client = room->clients[seat];
+	nbytes = daemon_read(room->daemon, client, bytes, sizeof(bytes));
 	for (i=0;i<nbytes;i++) {
-		direction = snake_get_direction(snake, &snake->players[client].head);
-		switch (bytes[i]) {
-			case 'q': daemon_disconnect(daemon, client); break;
-			case 'w': if (direction!=down)  snake->players[client].direction = up;    break;
-			case 'a': if (direction!=right) snake->players[client].direction = left;  break;
-			case 's': if (direction!=up)    snake->players[client].direction = down;  break;
-			case 'd': if (direction!=left)  snake->players[client].direction = right; break;
+		if (room->daemon->client_binary[client] && bytes[i] >= down && bytes[i] <= left) {
+			snake_queue_turn(snake, seat, bytes[i]);
+			continue;
+		}
+		switch ((unsigned char)bytes[i]) {
+			case 'q': daemon_disconnect(room->daemon, client); return;
+			case 'w': snake_queue_turn(snake, seat, up);    break;
+			case 'a': snake_queue_turn(snake, seat, left);  break;
+			case 's': snake_queue_turn(snake, seat, down);  break;
+			case 'd': snake_queue_turn(snake, seat, right); break;
+			case LOBBY_BINARY:
+				if (lobby_binary(room->daemon, client)) {
+					snake_send_start(room, seat);
+				}
+				break;
 		}
-		break;
 	}
 }
 
-void on_connect(daemon_t *daemon, int client)
+// bring a client from the frame it has to the current one, a client that
+// has nothing or fell too far behind gets the keyframe
+void snake_send_update(lobby_room_t *room, int seat)
 {
-	snake_t *snake = (snake_t *)daemon->context;
+	snake_t *snake = (snake_t *)room->context;
+	strbuf_t *sb = snake->sb;
+	daemon_frame_t *frame;
+	uint64_t since;
+	bool binary = room->daemon->client_binary[room->clients[seat]];
+
+	since = daemon_last_frame(room->daemon,room->clients[seat]);
+	if (since == snake->frame) {
+		return;
+	}
+	strbuf_reset(sb);
+	if (!snake_get_catchup(snake, sb, since, binary)) {
+		daemon_write_frame(room->daemon,room->clients[seat],snake_get_keyframe(snake, binary));
+		return;
+	}
+	frame = snake_frame(snake, binary);
+	daemon_write_frame(room->daemon,room->clients[seat],frame);
+	daemon_frame_release(frame);
+}
+
+void on_connect(lobby_room_t *room, int seat)
+{
+	snake_t *snake = (snake_t *)room->context;
+
+	snake_join(snake, seat);
+	// the snake that just joined is not on a keyframe of this tick yet
+	snake_release_keyframes(snake);
+
+	if (room->daemon->client_binary[room->clients[seat]]) {
+		snake_send_seat(room, seat);
+	}
+	if (snake_scrolling(snake)) {
+		snake_center(snake, seat);
+		snake_send_view(room, seat, true);
+		return;
+	}
+	snake_send_update(room, seat);
+}
 
-	int x = client * snake->width / daemon->slots;
+// the backlog was dropped, the client only needs what it missed, but a
+// view has moved since in ways that are not kept, so it is drawn anew
+void on_resync(lobby_room_t *room, int seat)
+{
+	snake_t *snake = (snake_t *)room->context;
 
-	if (!snake->players[client].length) {
-		snake->players[client].alive = true;
-		snake->players[client].head.x = x;
-		snake->players[client].head.y = 1;
-		snake->players[client].previous_head.x = x;
-		snake->players[client].previous_head.y = 1;
-		snake->players[client].tail.x = x;
-		snake->players[client].tail.y = 0;
-		snake->players[client].previous_tail.x = x;
-		snake->players[client].previous_tail.y = 0;
-		snake->players[client].length = 2;
-		snake->players[client].direction = down;
-		snake_set_direction(snake, &snake->players[client].head, down);
-		snake_set_direction(snake, &snake->players[client].tail, down);
+	if (snake_scrolling(snake)) {
+		snake_send_view(room, seat, true);
+		return;
 	}
+	snake_send_update(room, seat);
+}
 
-	strbuf_t *sb = strbuf_create();
+// a spectator may come from another room, whose frames tell nothing about
+// this one, so it always starts from the shared keyframe
+void on_watch(lobby_room_t *room, int client)
+{
+	snake_t *snake = (snake_t *)room->context;
 
-	snake_get_frame(snake, sb, true);
+	daemon_write_frame(room->daemon,client,snake_get_keyframe(snake, room->daemon->client_binary[client]));
+}
 
-	daemon_write(daemon,client,sb->buffer,strlen(sb->buffer)+1);
+void on_disconnect(lobby_room_t *room, int seat)
+{
+	snake_t *snake = (snake_t *)room->context;
 
-	strbuf_destroy(sb);
+	snake_leave(snake, seat);
 }
 
-void on_disconnect(daemon_t *daemon, int client)
+// size of the world of every room, set from the command line
+int snake_width = 40, snake_height = 20, snake_room_size = 2;
+
+// every room logs to the prefix with a number of its own, when given
+const char *snake_log_prefix = NULL;
+unsigned int snake_rooms = 0;
+
+void *snake_create_game(lobby_room_t *room)
 {
-	snake_t *snake = (snake_t *)daemon->context;
+	char filename[4096];
+	unsigned int number;
+	snake_t *snake = snake_create(snake_width, snake_height, room->size);
 
-	snake->players[client].alive = false;
+	// rooms of all shards count together, so no two share a log
+	number = __atomic_fetch_add(&snake_rooms, 1, __ATOMIC_RELAXED);
+	snake->seed = (unsigned int)time(NULL) ^ number * 2654435761U;
+	if (snake_log_prefix) {
+		snprintf(filename, sizeof(filename), "%s.%u", snake_log_prefix, number);
+		snake_log_open(snake, filename);
+	}
+	return (void *)snake;
 }
 
-void snake_start_game(daemon_t *daemon)
+void snake_destroy_game(void *context)
 {
-	int i, width = 40, height = 20;
+	snake_destroy((snake_t *)context);
+}
 
-	snake_t *snake = snake_create(width, height, daemon->slots);
-	daemon->context = (void *)snake;
+// the board with what is needed to send the next frame, the scratch space
+// and the keyframes are made again, the log is on disk first so the new
+// process appends to it
+void snake_save_game(lobby_room_t *room, daemon_state_t *state)
+{
+	int i;
+	bool logging;
+	uint32_t header[5];
+	unsigned int rooms;
+	snake_t *snake = (snake_t *)room->context;
+
+	header[0] = SNAKE_STATE_VERSION;
+	header[1] = snake->width;
+	header[2] = snake->height;
+	header[3] = snake->nplayers;
+	header[4] = sizeof(*snake->players);
+	daemon_save(state, header, sizeof(header));
+	daemon_save(state, snake->players, snake->nplayers*sizeof(*snake->players));
+	daemon_save(state, snake->cells, (size_t)snake->width*snake->height*sizeof(*snake->cells));
+	daemon_save(state, &snake->ndirty, sizeof(snake->ndirty));
+	daemon_save(state, snake->dirty, snake->ndirty*sizeof(*snake->dirty));
+	daemon_save(state, &snake->frame, sizeof(snake->frame));
+	for (i=0;i<SNAKE_HISTORY;i++) {
+		daemon_save(state, &snake->history[i].ncells, sizeof(snake->history[i].ncells));
+		daemon_save(state, snake->history[i].cells, snake->history[i].ncells*sizeof(*snake->history[i].cells));
+	}
+	daemon_save(state, snake->views, (snake->nplayers+1)*sizeof(*snake->views));
+	daemon_save(state, &snake->watched, sizeof(snake->watched));
+	daemon_save(state, &snake->seed, sizeof(snake->seed));
+	daemon_save(state, &snake->events->length, sizeof(snake->events->length));
+	daemon_save(state, snake->events->buffer, snake->events->length);
+	daemon_save(state, &snake->nevents, sizeof(snake->nevents));
+	rooms = __atomic_load_n(&snake_rooms, __ATOMIC_RELAXED);
+	daemon_save(state, &rooms, sizeof(rooms));
+	if (snake->log) {
+		snake_log_sync(snake);
+	}
+	logging = snake->log != NULL;
+	daemon_save(state, &logging, sizeof(logging));
+	if (logging) {
+		daemon_save_fd(state, snake->log_file->fd);
+	}
+}
 
-    // initialize users from lobby
+bool snake_load(snake_t *snake, daemon_state_t *state)
+{
+	int i, fd, ncells;
+	bool logging;
+	size_t length;
+	unsigned int rooms, current;
 
-	for (i=0;i<daemon->slots;i++) {
-		if (daemon->client_fd[i] >= 0) {
-			on_connect(daemon,i);
+	ncells = snake->width*snake->height;
+	daemon_load(state, snake->players, snake->nplayers*sizeof(*snake->players));
+	daemon_load(state, snake->cells, (size_t)ncells*sizeof(*snake->cells));
+	if (!daemon_load(state, &snake->ndirty, sizeof(snake->ndirty)) || snake->ndirty < 0 || snake->ndirty > ncells) {
+		return false;
+	}
+	snake->dirty_size = snake->ndirty > 64 ? snake->ndirty : 64;
+	snake->dirty = malloc(snake->dirty_size*sizeof(*snake->dirty));
+	daemon_load(state, snake->dirty, snake->ndirty*sizeof(*snake->dirty));
+	daemon_load(state, &snake->frame, sizeof(snake->frame));
+	for (i=0;i<SNAKE_HISTORY;i++) {
+		if (!daemon_load(state, &snake->history[i].ncells, sizeof(snake->history[i].ncells))
+				|| snake->history[i].ncells < 0 || snake->history[i].ncells > ncells) {
+			return false;
 		}
+		snake->history[i].size = snake->history[i].ncells;
+		snake->history[i].cells = malloc((snake->history[i].size ? snake->history[i].size : 1)*sizeof(*snake->history[i].cells));
+		daemon_load(state, snake->history[i].cells, snake->history[i].ncells*sizeof(*snake->history[i].cells));
+	}
+	daemon_load(state, snake->views, (snake->nplayers+1)*sizeof(*snake->views));
+	daemon_load(state, &snake->watched, sizeof(snake->watched));
+	daemon_load(state, &snake->seed, sizeof(snake->seed));
+	if (!daemon_load(state, &length, sizeof(length)) || strbuf_reserve(snake->events, length) < 0) {
+		return false;
+	}
+	daemon_load(state, snake->events->buffer, length);
+	snake->events->length = length;
+	snake->events->buffer[length] = 0;
+	daemon_load(state, &snake->nevents, sizeof(snake->nevents));
+	// rooms numbered before the handoff keep their logs
+	daemon_load(state, &rooms, sizeof(rooms));
+	current = __atomic_load_n(&snake_rooms, __ATOMIC_RELAXED);
+	while (current < rooms && !__atomic_compare_exchange_n(&snake_rooms, &current, rooms, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	// a load fails once one before it did, so this checks all of them
+	if (!daemon_load(state, &logging, sizeof(logging)) || snake->watched < 0 || snake->watched >= snake->nplayers) {
+		return false;
+	}
+	if (logging) {
+		fd = daemon_load_fd(state);
+		if (fd < 0) {
+			return false;
+		}
+		snake_log_attach(snake, fd);
+	}
+	return true;
+}
+
+void *snake_load_game(lobby_room_t *room, daemon_state_t *state)
+{
+	uint32_t header[5];
+	snake_t *snake;
+
+	if (!daemon_load(state, header, sizeof(header)) || header[0] != SNAKE_STATE_VERSION || header[4] != sizeof(struct snake_player_t)) {
+		fprintf(stderr, "Cannot take over a room saved by another version\n");
+		return NULL;
+	}
+	if (header[1] < 1 || header[2] < 1 || header[3] != (uint32_t)room->size) {
+		return NULL;
 	}
+	snake = snake_create(header[1], header[2], header[3]);
+	if (!snake_load(snake, state)) {
+		snake_destroy(snake);
+		return NULL;
+	}
+	return (void *)snake;
+}
+
+const lobby_game_t snake_game = {
+	snake_create_game,
+	snake_destroy_game,
+	on_connect,
+	on_disconnect,
+	on_data,
+	on_tick,
+	on_resync,
+	on_watch,
+	snake_save_game,
+	snake_load_game
+};
 
-	daemon->on_connect = on_connect;
-	daemon->on_disconnect = on_disconnect;
-	daemon->on_data = on_data;
-	daemon->on_tick = on_tick;
+// every shard hosts its own lobby and rooms
+void snake_on_start(daemon_t *daemon)
+{
+	lobby_run(daemon, &snake_game, snake_room_size);
+}
+
+// the benchmarks include this file and bring their own main
+#ifndef SNAKE_NO_MAIN
+void snake_usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-s shards] [-p] [-b select|epoll|uring] [-m metrics port] [-w width] [-h height] [-r room size] [-l log prefix] [-v watch port] port\n", name);
 }
 
 int main(int argc, char ** argv)
 {
-	if (argc < 2) {
-		fprintf(stderr, "Usage: %s [port]\n",argv[0]);
+	int option, port, shards = 1, backend = backend_auto, metrics_port = 0, watch_port = 0;
+	bool pin_cpus = false;
+
+	while ((option = getopt(argc, argv, "s:pb:m:w:h:r:l:v:")) != -1) {
+		switch (option) {
+			case 's': shards = atoi(optarg) > 1 ? atoi(optarg) : 1; break;
+			case 'p': pin_cpus = true; break;
+			case 'b':
+				if (!strcmp(optarg,"select")) backend = backend_select;
+				else if (!strcmp(optarg,"epoll")) backend = backend_epoll;
+				else if (!strcmp(optarg,"uring")) backend = backend_uring;
+				else {
+					fprintf(stderr, "Unknown backend %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'm': metrics_port = atoi(optarg); break;
+			case 'w': snake_width = atoi(optarg); break;
+			case 'h': snake_height = atoi(optarg); break;
+			case 'r': snake_room_size = atoi(optarg); break;
+			case 'l': snake_log_prefix = *optarg ? optarg : NULL; break;
+			case 'v': watch_port = atoi(optarg); break;
+			default:
+				snake_usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
+		snake_usage(argv[0]);
 		return EXIT_FAILURE;
 	}
 
-	int port = atoi(argv[1]);
+	port = atoi(argv[optind]);
 
 	if (!port) {
 		fprintf(stderr, "Invalid port number\n");
 		return EXIT_FAILURE;
 	}
 
-	int ip = 0, slots = 2, ticks = 10, width = 40, height = 20;
+	int ip = 0, slots = 4096, ticks = 10;
+
+	// a room bigger than the slots of a shard would never fill up
+	if (snake_width < 1 || snake_height < 1 || snake_room_size < 1 || snake_room_size > SNAKE_MAX_PLAYERS
+			|| snake_room_size > slots) {
+		fprintf(stderr, "Invalid world size or room size\n");
+		return EXIT_FAILURE;
+	}
 
 	daemon_t *daemon = daemon_create(ip, port, slots, ticks);
-	lobby_run(daemon, snake_start_game);
+	daemon->shards = shards;
+	daemon->pin_cpus = pin_cpus;
+	daemon->backend = backend;
+	daemon->metrics_port = metrics_port;
+	daemon->watch_port = watch_port;
+	daemon->on_start = snake_on_start;
 
 	return daemon_run(daemon)?EXIT_SUCCESS:EXIT_FAILURE;
 }
+#endif
@@ -2,7 +2,6 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
-#include <assert.h>
 
 #include "strbuf.h"
 
@@ -13,6 +12,7 @@ strbuf_t *strbuf_create()
 		return NULL;
 	}
 	sb->size = 1024;
+	sb->length = 0;
 	sb->buffer = malloc(sb->size);
 	if (sb->buffer == NULL) {
 		free(sb);
@@ -28,87 +28,139 @@ void strbuf_destroy(strbuf_t *sb)
 	free(sb);
 }
 
-int strbuf_append_str(strbuf_t *sb, char *str, size_t len)
+// the size doubles, so appending is amortized constant time
+int strbuf_reserve(strbuf_t *sb, size_t nbytes)
 {
 	size_t size = sb->size;
-	size_t pos = strlen(sb->buffer);
+	char *buffer;
 
-	while (size < pos+len+1) {
+	while (size < sb->length+nbytes+1) {
 		size *= 2;
 	}
 	if (size > sb->size) {
-		sb->buffer = realloc(sb->buffer, size);
-		sb->size = size;
-		if (sb->buffer == NULL) {
+		buffer = realloc(sb->buffer, size);
+		if (buffer == NULL) {
 			return -1;
 		}
+		sb->buffer = buffer;
+		sb->size = size;
 	}
-
-	memcpy(sb->buffer+pos,str,len+1);
-	return len;
+	return 0;
 }
 
-int strbuf_vappend(strbuf_t *sb, const char *fmt, va_list ap)
+void strbuf_reset(strbuf_t *sb)
 {
-    int n, result;
-    int size = 1024; /* Guess we need no more than 1024 bytes */
-    char *p, *np;
-
-    p = malloc(size);
-    if (p == NULL) {
-    	return -1;
-    }
-
-    result = -1;
-    while (1) {
-
-        /* Try to print in the allocated space */
+	sb->length = 0;
+	sb->buffer[0] = 0;
+}
 
-        n = vsnprintf(p, size, fmt, ap);
+void strbuf_shrink(strbuf_t *sb, size_t keep)
+{
+	char *buffer;
 
-        /* Check error code */
+	strbuf_reset(sb);
+	if (sb->size <= keep) {
+		return;
+	}
+	buffer = realloc(sb->buffer, keep);
+	if (buffer != NULL) {
+		sb->buffer = buffer;
+		sb->size = keep;
+	}
+}
 
-        if (n < 0) {
-        	break;
-        }
+int strbuf_append_str(strbuf_t *sb, const char *str, size_t len)
+{
+	if (sb->length+len+1 > sb->size && strbuf_reserve(sb, len) < 0) {
+		return -1;
+	}
+	memcpy(sb->buffer+sb->length,str,len);
+	sb->length += len;
+	sb->buffer[sb->length] = 0;
+	return len;
+}
 
-        /* If that worked, return the string */
+int strbuf_append_char(strbuf_t *sb, char c)
+{
+	if (sb->length+2 > sb->size && strbuf_reserve(sb, 1) < 0) {
+		return -1;
+	}
+	sb->buffer[sb->length++] = c;
+	sb->buffer[sb->length] = 0;
+	return 1;
+}
 
-        if (n < size) {
-        	result = strbuf_append_str(sb,p,n);
-        	break;
-        }
+int strbuf_append_int(strbuf_t *sb, int value)
+{
+	char digits[12];
+	int n = sizeof(digits);
+	unsigned int u = value < 0 ? -(unsigned int)value : (unsigned int)value;
+
+	// digits are written back to front
+	do {
+		digits[--n] = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	if (value < 0) {
+		digits[--n] = '-';
+	}
+	return strbuf_append_str(sb, digits+n, sizeof(digits)-n);
+}
 
-        /* Else try again with more space */
+int strbuf_append_cursor(strbuf_t *sb, int row, int col)
+{
+	size_t length = sb->length;
 
-        size = n + 1;       /* Precisely what is needed */
+	if (strbuf_reserve(sb, 2+11+1+11+1) < 0) {
+		return -1;
+	}
+	strbuf_append_literal(sb, "\e[");
+	strbuf_append_int(sb, row);
+	strbuf_append_char(sb, ';');
+	strbuf_append_int(sb, col);
+	strbuf_append_char(sb, 'H');
+	return sb->length - length;
+}
 
-        p = realloc(p, size);
-        if (p == NULL) {
-            break;
-        }
-    }
-    if (p != NULL) {
-    	free(p);
-    }
-    return result;
+// format straight into the free space, grow and retry when it did not fit
+int strbuf_vappend(strbuf_t *sb, const char *fmt, va_list ap)
+{
+	int n;
+	va_list aq;
+
+	va_copy(aq, ap);
+	n = vsnprintf(sb->buffer+sb->length, sb->size-sb->length, fmt, aq);
+	va_end(aq);
+	if (n < 0) {
+		sb->buffer[sb->length] = 0;
+		return -1;
+	}
+	if ((size_t)n >= sb->size-sb->length) {
+		if (strbuf_reserve(sb, n) < 0) {
+			sb->buffer[sb->length] = 0;
+			return -1;
+		}
+		vsnprintf(sb->buffer+sb->length, sb->size-sb->length, fmt, ap);
+	}
+	sb->length += n;
+	return n;
 }
 
 int strbuf_append(strbuf_t *sb, const char *fmt, ...)
 {
-    va_list ap;
-    va_start(ap, fmt);
-    int res = strbuf_vappend(sb,fmt,ap);
-    va_end(ap);
-    return res;
+	va_list ap;
+	va_start(ap, fmt);
+	int res = strbuf_vappend(sb,fmt,ap);
+	va_end(ap);
+	return res;
 }
 
 int strbuf_set(strbuf_t *sb, const char *fmt, ...)
 {
-	sb->buffer[0]=0;
+	strbuf_reset(sb);
 	va_list ap;
-    va_start(ap, fmt);
-    int res = strbuf_vappend(sb,fmt,ap);
-    va_end(ap);
-    return res;
+	va_start(ap, fmt);
+	int res = strbuf_vappend(sb,fmt,ap);
+	va_end(ap);
+	return res;
 }
@@ -1,17 +1,45 @@
 #ifndef STRBUF_H_
 #define STRBUF_H_
 
+#include <stddef.h>
+#include <stdarg.h>
+
+// the buffer is always zero terminated, length excludes the terminator
 typedef struct {
 	char *buffer;
 	size_t size;
+	size_t length;
 } strbuf_t;
 
 strbuf_t *strbuf_create();
 
 void strbuf_destroy(strbuf_t *sb);
 
+// make room for nbytes more, so that many can be appended without growing
+int strbuf_reserve(strbuf_t *sb, size_t nbytes);
+
+void strbuf_reset(strbuf_t *sb);
+
+// empty the buffer and give back the memory above keep bytes
+void strbuf_shrink(strbuf_t *sb, size_t keep);
+
 int strbuf_append(strbuf_t *sb, const char *fmt, ...);
 
+int strbuf_vappend(strbuf_t *sb, const char *fmt, va_list ap);
+
 int strbuf_set(strbuf_t *sb, const char *fmt, ...);
 
+// appends that do not go through printf
+int strbuf_append_str(strbuf_t *sb, const char *str, size_t len);
+
+int strbuf_append_char(strbuf_t *sb, char c);
+
+int strbuf_append_int(strbuf_t *sb, int value);
+
+// the CSI cursor position sequence "\e[row;colH"
+int strbuf_append_cursor(strbuf_t *sb, int row, int col);
+
+// a string literal, its length is known at compile time
+#define strbuf_append_literal(sb, str) strbuf_append_str(sb, str, sizeof(str) - 1)
+
 #endif /* STRBUF_H_ */
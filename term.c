@@ -0,0 +1,225 @@
+/*
+ ============================================================================
+ Name        : term.c
+ Description : ANSI terminal encoder that writes as few bytes as it can
+ Author      : Maurits van der Schee <maurits@vdschee.nl>
+ URL         : https://github.com/mevdschee/daemon-games
+ ============================================================================
+ */
+
+#include "term.h"
+
+int term_digits(int n)
+{
+	int digits = 1;
+
+	while (n >= 10) {
+		n /= 10;
+		digits++;
+	}
+	return digits;
+}
+
+// a relative move "\e[nX", where a count of one can be left out
+int term_step_cost(int n)
+{
+	if (n == 0) {
+		return 0;
+	}
+	return n == 1 ? 3 : 3 + term_digits(n);
+}
+
+void term_step(term_t *term, int n, char final)
+{
+	if (n == 0) {
+		return;
+	}
+	strbuf_append_literal(term->sb, "\e[");
+	if (n > 1) {
+		strbuf_append_int(term->sb, n);
+	}
+	strbuf_append_char(term->sb, final);
+}
+
+// "\e[row;colH" where a column or both of 1 can be left out
+int term_jump_cost(int row, int col)
+{
+	if (col == 0) {
+		return row == 0 ? 3 : 3 + term_digits(row+1);
+	}
+	return 4 + term_digits(row+1) + term_digits(col+1);
+}
+
+void term_jump(term_t *term, int row, int col)
+{
+	strbuf_append_literal(term->sb, "\e[");
+	if (row || col) {
+		strbuf_append_int(term->sb, row+1);
+	}
+	if (col) {
+		strbuf_append_char(term->sb, ';');
+		strbuf_append_int(term->sb, col+1);
+	}
+	strbuf_append_char(term->sb, 'H');
+}
+
+// within a row either step or return to the start and step from there
+int term_horizontal_cost(int from, int to, bool *cr)
+{
+	int step, restart;
+
+	step = term_step_cost(to > from ? to - from : from - to);
+	restart = 1 + term_step_cost(to);
+	*cr = restart < step;
+	return *cr ? restart : step;
+}
+
+void term_horizontal(term_t *term, int from, int to, bool cr)
+{
+	if (cr) {
+		strbuf_append_char(term->sb, '\r');
+		from = 0;
+	}
+	if (to > from) {
+		term_step(term, to - from, 'C');
+	} else {
+		term_step(term, from - to, 'D');
+	}
+}
+
+void term_start(term_t *term, strbuf_t *sb, int cols)
+{
+	term->sb = sb;
+	term->cols = cols;
+	term->row = -1;
+	term->col = -1;
+	term->sgr_known = false;
+}
+
+void term_move(term_t *term, int row, int col)
+{
+	int best, cost, rows, lines;
+	bool cr, line_cr;
+
+	if (term->row == row && term->col == col) {
+		return;
+	}
+	if (term->row < 0) {
+		term_jump(term, row, col);
+		term->row = row;
+		term->col = col;
+		return;
+	}
+	// candidates: an absolute jump, stepping up or down and sideways, or
+	// line feeds after a carriage return, which is also the way back from
+	// a column that is not known
+	best = term_jump_cost(row, col);
+	rows = row - term->row;
+	cost = term_step_cost(rows > 0 ? rows : -rows);
+	if (term->col < 0) {
+		cr = true;
+		cost += 1 + term_step_cost(col);
+	} else {
+		cost += term_horizontal_cost(term->col, col, &cr);
+	}
+	lines = rows > 0 ? 2 * rows + term_horizontal_cost(0, col, &line_cr) : best;
+	if (lines < best && lines <= cost) {
+		for (;rows>0;rows--) {
+			strbuf_append_literal(term->sb, "\r\n");
+		}
+		term_horizontal(term, 0, col, line_cr);
+	} else if (cost < best) {
+		term_step(term, rows > 0 ? rows : -rows, rows > 0 ? 'B' : 'A');
+		term_horizontal(term, term->col, col, cr);
+	} else {
+		term_jump(term, row, col);
+	}
+	term->row = row;
+	term->col = col;
+}
+
+void term_sgr(term_t *term, bool bold, int fg, int bg)
+{
+	bool first;
+
+	if (term->sgr_known && term->bold == bold && term->fg == fg && term->bg == bg) {
+		return;
+	}
+	strbuf_append_literal(term->sb, "\e[");
+	// bold can only be switched off by a reset, which clears the colors too
+	if (!term->sgr_known || (term->bold && !bold)) {
+		strbuf_append_char(term->sb, '0');
+		if (bold) {
+			strbuf_append_literal(term->sb, ";1");
+		}
+		strbuf_append_literal(term->sb, ";3");
+		strbuf_append_char(term->sb, '0' + fg);
+		strbuf_append_literal(term->sb, ";4");
+		strbuf_append_char(term->sb, '0' + bg);
+	} else {
+		first = true;
+		if (bold && !term->bold) {
+			strbuf_append_char(term->sb, '1');
+			first = false;
+		}
+		if (fg != term->fg) {
+			if (!first) {
+				strbuf_append_char(term->sb, ';');
+			}
+			strbuf_append_char(term->sb, '3');
+			strbuf_append_char(term->sb, '0' + fg);
+			first = false;
+		}
+		if (bg != term->bg) {
+			if (!first) {
+				strbuf_append_char(term->sb, ';');
+			}
+			strbuf_append_char(term->sb, '4');
+			strbuf_append_char(term->sb, '0' + bg);
+		}
+	}
+	strbuf_append_char(term->sb, 'm');
+	term->sgr_known = true;
+	term->bold = bold;
+	term->fg = fg;
+	term->bg = bg;
+}
+
+void term_text(term_t *term, const char *text, int len)
+{
+	strbuf_append_str(term->sb, text, len);
+	if (term->col >= 0) {
+		term->col += len;
+		if (term->col >= term->cols) {
+			term->col = -1;
+		}
+	}
+}
+
+void term_region(term_t *term, int rows)
+{
+	strbuf_append_literal(term->sb, "\e[1;");
+	strbuf_append_int(term->sb, rows);
+	strbuf_append_char(term->sb, 'r');
+	term->row = 0;
+	term->col = 0;
+}
+
+void term_scroll(term_t *term, int rows)
+{
+	if (rows > 0) {
+		term_step(term, rows, 'S');
+	} else {
+		term_step(term, -rows, 'T');
+	}
+}
+
+void term_delete(term_t *term, int cols)
+{
+	term_step(term, cols, 'P');
+}
+
+void term_insert(term_t *term, int cols)
+{
+	term_step(term, cols, '@');
+}
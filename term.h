@@ -0,0 +1,56 @@
+/*
+ ============================================================================
+ Name        : term.h
+ Description : ANSI terminal encoder that writes as few bytes as it can
+ Author      : Maurits van der Schee <maurits@vdschee.nl>
+ URL         : https://github.com/mevdschee/daemon-games
+ ============================================================================
+ */
+
+#ifndef TERM_H_
+#define TERM_H_
+
+#include <stdbool.h>
+
+#include "strbuf.h"
+
+typedef struct term_t term_t;
+
+// what the terminal shows after the bytes written so far, rows and columns
+// count from 0 and are -1 while unknown
+struct term_t {
+	strbuf_t *sb;
+	// columns of the frame, text up to the last one leaves the cursor there
+	// until the next character, which terminals do not agree on moving from
+	int cols;
+	int row;
+	int col;
+	bool sgr_known;
+	bool bold;
+	int fg;
+	int bg;
+};
+
+// a frame may reach a client after any other frame, so it assumes nothing
+void term_start(term_t *term, strbuf_t *sb, int cols);
+
+// the cheapest of an absolute jump, relative moves or a carriage return
+void term_move(term_t *term, int row, int col);
+
+// only the attributes that differ are sent
+void term_sgr(term_t *term, bool bold, int fg, int bg);
+
+// printable text without line breaks, the cursor advances over it
+void term_text(term_t *term, const char *text, int len);
+
+// scroll only the top rows, this also moves the cursor home
+void term_region(term_t *term, int rows);
+
+// move the contents of the scroll region up, or down when negative
+void term_scroll(term_t *term, int rows);
+
+// shift the rest of the line left or right of the cursor, which stays put
+void term_delete(term_t *term, int cols);
+void term_insert(term_t *term, int cols);
+
+#endif /* TERM_H_ */
@@ -0,0 +1,93 @@
+/*
+ ============================================================================
+ Name        : wire.c
+ Description : Binary encoder for clients that are not terminals
+ Author      : Maurits van der Schee <maurits@vdschee.nl>
+ URL         : https://github.com/mevdschee/daemon-games
+ ============================================================================
+ */
+
+#include <string.h>
+
+#include "wire.h"
+
+// seven bits per byte, the high bit is set on all but the last
+void wire_append_varint(strbuf_t *sb, unsigned int value)
+{
+	while (value >= 0x80) {
+		strbuf_append_char(sb, (char)(value | 0x80));
+		value >>= 7;
+	}
+	strbuf_append_char(sb, (char)value);
+}
+
+void wire_start(wire_t *wire, strbuf_t *sb, int type)
+{
+	wire->sb = sb;
+	wire->start = sb->length;
+	wire->next = 0;
+	wire->run = false;
+	strbuf_append_char(sb, (char)type);
+}
+
+void wire_byte(wire_t *wire, int value)
+{
+	strbuf_append_char(wire->sb, (char)value);
+}
+
+void wire_varint(wire_t *wire, unsigned int value)
+{
+	wire_append_varint(wire->sb, value);
+}
+
+void wire_signed(wire_t *wire, int value)
+{
+	wire_append_varint(wire->sb, (unsigned int)value << 1 ^ (unsigned int)(value >> 31));
+}
+
+void wire_bytes(wire_t *wire, const char *bytes, int nbytes)
+{
+	strbuf_append_str(wire->sb, bytes, nbytes);
+}
+
+// a cell right behind the last one continues its run, so a run of changes
+// costs two bytes more than its values
+void wire_cell(wire_t *wire, int position, unsigned int value)
+{
+	if (!wire->run || position != wire->next) {
+		if (wire->run) {
+			wire_append_varint(wire->sb, 0);
+		}
+		wire_append_varint(wire->sb, position - wire->next);
+		wire->run = true;
+	}
+	wire_append_varint(wire->sb, value + 1);
+	wire->next = position + 1;
+}
+
+// the length is only known now, so the message moves up to make room
+int wire_end(wire_t *wire)
+{
+	strbuf_t *sb = wire->sb;
+	size_t length, prefix;
+	char bytes[5];
+
+	if (wire->run) {
+		wire_append_varint(sb, 0);
+	}
+	length = sb->length - wire->start;
+	prefix = 0;
+	do {
+		bytes[prefix] = (char)(length >> (prefix*7) & 0x7f);
+		if (length >> ((prefix+1)*7)) {
+			bytes[prefix] |= 0x80;
+		}
+		prefix++;
+	} while (length >> (prefix*7));
+	strbuf_reserve(sb, prefix);
+	memmove(sb->buffer + wire->start + prefix, sb->buffer + wire->start, length);
+	memcpy(sb->buffer + wire->start, bytes, prefix);
+	sb->length += prefix;
+	sb->buffer[sb->length] = 0;
+	return length + prefix;
+}
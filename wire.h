@@ -0,0 +1,52 @@
+/*
+ ============================================================================
+ Name        : wire.h
+ Description : Binary encoder for clients that are not terminals
+ Author      : Maurits van der Schee <maurits@vdschee.nl>
+ URL         : https://github.com/mevdschee/daemon-games
+ ============================================================================
+ */
+
+#ifndef WIRE_H_
+#define WIRE_H_
+
+#include <stdbool.h>
+
+#include "strbuf.h"
+
+typedef struct wire_t wire_t;
+
+// a message is its length as a varint followed by that many bytes, which
+// start with its type, the cells of a grid end it as runs of a varint skip
+// over unchanged cells, the values plus one as varints and a zero
+struct wire_t {
+	strbuf_t *sb;
+	// where the message starts in the buffer
+	size_t start;
+	// position in the grid after the last cell, and whether its run is open
+	int next;
+	bool run;
+};
+
+// the buffer may already hold earlier messages
+void wire_start(wire_t *wire, strbuf_t *sb, int type);
+
+void wire_byte(wire_t *wire, int value);
+
+void wire_varint(wire_t *wire, unsigned int value);
+
+// zigzag, so small negative values take a byte as well
+void wire_signed(wire_t *wire, int value);
+
+void wire_bytes(wire_t *wire, const char *bytes, int nbytes);
+
+// cells have to come in order of position, after everything else
+void wire_cell(wire_t *wire, int position, unsigned int value);
+
+// puts the length in front, returns the size of the whole message
+int wire_end(wire_t *wire);
+
+// a varint on its own, for parts that are encoded once and copied in
+void wire_append_varint(strbuf_t *sb, unsigned int value);
+
+#endif /* WIRE_H_ */